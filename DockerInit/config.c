@@ -0,0 +1,298 @@
+#include "init.h"
+#include "libchild.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+/*
+ * The config file is a list of sections, one per task:
+ *
+ *   # comment
+ *   [web]
+ *   program=/usr/bin/server
+ *   user=www
+ *   arg=--port
+ *   arg=8080
+ *   env=PATH=/usr/bin:/bin
+ *   restart=yes
+ *   deadline=0
+ *   kill_signal=15
+ *   kill_grace=5000
+ *   stop_group=0
+ *   process_group=yes
+ *
+ * argv[0] is the program unless argv0= is given. Without any env= lines
+ * the task inherits the environment of docker-init.
+ */
+
+static int packAppend(char*** pack, const char* value){
+    size_t count = 0;
+    if(*pack){
+        while((*pack)[count]) count++;
+    }
+
+    char** newPack = realloc(*pack, sizeof(char*) * (count + 2));
+    if(!newPack){
+        return -1;
+    }
+    *pack = newPack;
+
+    newPack[count] = strdup(value);
+    newPack[count + 1] = NULL;
+    if(!newPack[count]){
+        return -1;
+    }
+
+    return 0;
+}
+
+static void packFree(char** pack){
+    if(!pack) return;
+
+    for(char** it = pack; *it; it++){
+        free(*it);
+    }
+    free(pack);
+}
+
+static int packEqual(char** a, char** b){
+    if(!a || !b){
+        return a == b;
+    }
+
+    while(*a && *b){
+        if(strcmp(*a, *b)) return 0;
+        a++;
+        b++;
+    }
+
+    return *a == *b;
+}
+
+static int stringEqual(const char* a, const char* b){
+    if(!a || !b){
+        return a == b;
+    }
+    return !strcmp(a, b);
+}
+
+static int parseUnsigned(const char* value, unsigned int* result){
+    char* end;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 0);
+    if(errno || end == value || *end || parsed > 0xFFFFFFFFUL){
+        return -1;
+    }
+
+    *result = parsed;
+    return 0;
+}
+
+static char* trim(char* str){
+    while(isspace((unsigned char)*str)) str++;
+
+    char* end = str + strlen(str);
+    while(end > str && isspace((unsigned char)end[-1])) end--;
+    *end = 0;
+
+    return str;
+}
+
+void configFreeTask(struct taskConfig* config){
+    free(config->name);
+    free(config->program);
+    free(config->username);
+    packFree(config->argv);
+    packFree(config->env);
+    free(config);
+}
+
+void configFree(struct taskConfig* config){
+    while(config){
+        struct taskConfig* next = config->next;
+        configFreeTask(config);
+        config = next;
+    }
+}
+
+int configEqual(struct taskConfig* a, struct taskConfig* b){
+    return stringEqual(a->name, b->name) &&
+           stringEqual(a->program, b->program) &&
+           stringEqual(a->username, b->username) &&
+           packEqual(a->argv, b->argv) &&
+           packEqual(a->env, b->env) &&
+           a->restart == b->restart &&
+           a->deadlineMs == b->deadlineMs &&
+           a->killSignal == b->killSignal &&
+           a->killGraceMs == b->killGraceMs &&
+           a->stopGroup == b->stopGroup &&
+           a->execFlags == b->execFlags;
+}
+
+/* Puts argv[0] in front and checks the section is complete */
+static int configFinishTask(struct taskConfig* config, char** args, char* argv0){
+    if(!config->program){
+        fprintf(stderr, "Task %s has no program\n", config->name);
+        return -1;
+    }
+
+    if(packAppend(&config->argv, argv0 ? argv0 : config->program)){
+        return -1;
+    }
+
+    for(char** it = args; it && *it; it++){
+        if(packAppend(&config->argv, *it)){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int configLoad(const char* path, struct taskConfig** result){
+    FILE* file = fopen(path, "r");
+    if(!file){
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct taskConfig* head = NULL;
+    struct taskConfig** tail = &head;
+    struct taskConfig* current = NULL;
+    char** args = NULL;
+    char* argv0 = NULL;
+    int failed = 0;
+
+    char* line = NULL;
+    size_t lineSize = 0;
+    unsigned int lineNumber = 0;
+
+    while(!failed && getline(&line, &lineSize, file) >= 0){
+        lineNumber++;
+        char* str = trim(line);
+
+        if(!*str || *str == '#'){
+            continue;
+        }
+
+        if(*str == '['){
+            char* end = strchr(str, ']');
+            if(!end || end[1] || end == str + 1){
+                fprintf(stderr, "%s:%u: Bad section header\n", path, lineNumber);
+                failed = 1;
+                break;
+            }
+            *end = 0;
+
+            if(current && configFinishTask(current, args, argv0)){
+                failed = 1;
+                break;
+            }
+            packFree(args);
+            free(argv0);
+            args = NULL;
+            argv0 = NULL;
+
+            for(struct taskConfig* it = head; it; it = it->next){
+                if(!strcmp(it->name, str + 1)){
+                    fprintf(stderr, "%s:%u: Duplicate task %s\n", path, lineNumber, str + 1);
+                    failed = 1;
+                    break;
+                }
+            }
+            if(failed) break;
+
+            current = calloc(1, sizeof(struct taskConfig));
+            if(!current){
+                failed = 1;
+                break;
+            }
+            *tail = current;
+            tail = &current->next;
+
+            current->killSignal = 15;
+            current->killGraceMs = 5000;
+            current->name = strdup(str + 1);
+            if(!current->name){
+                failed = 1;
+            }
+            continue;
+        }
+
+        char* value = strchr(str, '=');
+        if(!current || !value){
+            fprintf(stderr, "%s:%u: Expected key=value inside a [task] section\n", path, lineNumber);
+            failed = 1;
+            break;
+        }
+        *value++ = 0;
+        char* key = trim(str);
+        value = trim(value);
+
+        char** string = NULL;
+        if(!strcmp(key, "program")){
+            string = &current->program;
+        }else if(!strcmp(key, "user")){
+            string = &current->username;
+        }else if(!strcmp(key, "argv0")){
+            string = &argv0;
+        }else if(!strcmp(key, "arg")){
+            failed = packAppend(&args, value);
+        }else if(!strcmp(key, "env")){
+            failed = packAppend(&current->env, value);
+        }else if(!strcmp(key, "restart")){
+            current->restart = !strcmp(value, "yes") || !strcmp(value, "always") || !strcmp(value, "1");
+        }else if(!strcmp(key, "deadline")){
+            failed = parseUnsigned(value, &current->deadlineMs);
+        }else if(!strcmp(key, "kill_signal")){
+            unsigned int sig = 0;
+            failed = parseUnsigned(value, &sig);
+            current->killSignal = sig;
+        }else if(!strcmp(key, "kill_grace")){
+            failed = parseUnsigned(value, &current->killGraceMs);
+        }else if(!strcmp(key, "stop_group")){
+            failed = parseUnsigned(value, &current->stopGroup);
+        }else if(!strcmp(key, "process_group")){
+            if(!strcmp(value, "session")){
+                current->execFlags = CHILD_EXEC_SESSION;
+            }else if(!strcmp(value, "yes") || !strcmp(value, "1")){
+                current->execFlags = CHILD_EXEC_PROCESS_GROUP;
+            }else{
+                current->execFlags = 0;
+            }
+        }else{
+            fprintf(stderr, "%s:%u: Unknown key %s\n", path, lineNumber, key);
+            failed = 1;
+            break;
+        }
+
+        if(string){
+            free(*string);
+            *string = strdup(value);
+            failed = !*string;
+        }
+
+        if(failed){
+            fprintf(stderr, "%s:%u: Invalid value for %s\n", path, lineNumber, key);
+        }
+    }
+
+    if(!failed && current && configFinishTask(current, args, argv0)){
+        failed = 1;
+    }
+
+    packFree(args);
+    free(argv0);
+    free(line);
+    fclose(file);
+
+    if(failed){
+        configFree(head);
+        return -1;
+    }
+
+    *result = head;
+    return 0;
+}
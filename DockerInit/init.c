@@ -7,56 +7,326 @@
 #include <string.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+
+/* Restart delay starts here and doubles for every exit that follows a short run */
+#define RESTART_DELAY_MIN_MS   1000
+#define RESTART_DELAY_MAX_MS   60000
+/* A task that ran this long is considered healthy again */
+#define RESTART_STABLE_MS      10000
+/* This many exits inside the window is a crash loop: hold off for the maximum delay */
+#define CRASH_LOOP_EXITS       5
+#define CRASH_LOOP_WINDOW_MS   30000
+
+#define DEFAULT_CONFIG "/etc/docker-init.conf"
+
+/* Everything is killed when shutdown takes longer than this */
+#define SHUTDOWN_TIMEOUT_MS    10000
 
 LibChild* lib;
 int taskShutdown = 0;
+int reloadRequested = 0;
 
 struct task {
     Child* child;
-    char* program;
-    char* username;
-    char** argv;
-    char** env;
-    int restart;
-    int taskId;
+    struct taskConfig* config;
+    /* Takes over from config once the running child has exited */
+    struct taskConfig* replacement;
+    /* No longer in the config, freed once the child has exited */
+    int removed;
+    /* The stop signal was sent during shutdown */
+    int stopping;
+    /* Inside libChildExecWithOptions, a child that ends there is handled once it returns */
+    int starting;
+    int endedWhileStarting;
+    unsigned int taskId;
+    unsigned int generation;
+
+    uint64_t startedAt;
+    uint64_t restartAt;
+    unsigned int restartDelayMs;
+    uint64_t crashWindowStart;
+    unsigned int crashWindowExits;
 };
 
-struct task* activeTasks[128] = {};
+/* Task table, free slots are kept on a stack so allocation is O(1) */
+struct task** tasks = NULL;
+unsigned int taskSlots = 0;
+unsigned int* freeSlots = NULL;
+unsigned int freeSlotCount = 0;
+
+static uint64_t nowMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int allocSlot(struct task* t){
+    if(!freeSlotCount){
+        unsigned int newSlots = taskSlots ? taskSlots * 2 : 16;
+
+        struct task** newTasks = realloc(tasks, sizeof(struct task*) * newSlots);
+        if(!newTasks){
+            return -1;
+        }
+        tasks = newTasks;
+
+        unsigned int* newFree = realloc(freeSlots, sizeof(unsigned int) * newSlots);
+        if(!newFree){
+            return -1;
+        }
+        freeSlots = newFree;
+
+        /* Push in reverse so the lowest slot is handed out first */
+        for(unsigned int i=newSlots; i>taskSlots; i--){
+            tasks[i - 1] = NULL;
+            freeSlots[freeSlotCount++] = i - 1;
+        }
+        taskSlots = newSlots;
+    }
+
+    t->taskId = freeSlots[--freeSlotCount];
+    tasks[t->taskId] = t;
+
+    return 0;
+}
+
+static void freeTask(struct task* t){
+    tasks[t->taskId] = NULL;
+    freeSlots[freeSlotCount++] = t->taskId;
+
+    configFreeTask(t->config);
+    if(t->replacement){
+        configFreeTask(t->replacement);
+    }
+    free(t);
+}
 
 static void stateChange(Child* child, void* param, enum childStates state);
 
 static void childData(Child* child, void* param, char* buffer, size_t len, int isErr){
-    printf("Child=%p, isErr=%u, Buffer=\"%s\"\n", child, isErr, buffer);
+    struct task* t = (struct task*)param;
+    printf("Task=%s, isErr=%u, Buffer=\"%s\"\n", t->config->name, isErr, buffer);
 }
 
+static void scheduleRestart(struct task* t);
+static void taskEnded(struct task* t);
+
+/* Frees the task if it cannot be started and will not be restarted */
 static void runTask(struct task* t){
-    t->child = libChildExec(lib, t->program, t->username, t->argv, t->env, stateChange, childData, t);
+    struct taskConfig* config = t->config;
+
+    struct childExecOptions options;
+    libChildExecOptionsInit(&options);
+    options.flags = config->execFlags;
+    options.deadlineMs = config->deadlineMs;
+    options.killSignal = config->killSignal;
+    options.killGraceMs = config->killGraceMs;
+
+    t->restartAt = 0;
+    t->startedAt = nowMs();
+    /* The call polls the worker, so the child may already have ended and been freed when it returns */
+    t->starting = 1;
+    Child* child = libChildExecWithOptions(lib, config->program, config->username, config->argv,
+                                           config->env ? config->env : __environ, &options,
+                                           stateChange, childData, t);
+    t->starting = 0;
+
+    if(t->endedWhileStarting){
+        t->endedWhileStarting = 0;
+        taskEnded(t);
+        return;
+    }
+
+    t->child = child;
+    if(!t->child){
+        if(config->restart){
+            scheduleRestart(t);
+        }else{
+            fprintf(stderr, "Failed to start task %s\n", config->name);
+            freeTask(t);
+        }
+    }
+}
+
+static void stopTask(struct task* t){
+    if(t->child){
+        libChildTerminate(t->child, t->config->killSignal, t->config->killGraceMs, SIGKILL);
+    }
+}
+
+static void scheduleRestart(struct task* t){
+    uint64_t now = nowMs();
+
+    if(now - t->startedAt >= RESTART_STABLE_MS){
+        t->restartDelayMs = RESTART_DELAY_MIN_MS;
+    }else if(!t->restartDelayMs){
+        t->restartDelayMs = RESTART_DELAY_MIN_MS;
+    }else if(t->restartDelayMs < RESTART_DELAY_MAX_MS / 2){
+        t->restartDelayMs *= 2;
+    }else{
+        t->restartDelayMs = RESTART_DELAY_MAX_MS;
+    }
+
+    if(now - t->crashWindowStart >= CRASH_LOOP_WINDOW_MS){
+        t->crashWindowStart = now;
+        t->crashWindowExits = 0;
+    }
+
+    unsigned int delay = t->restartDelayMs;
+    if(++t->crashWindowExits >= CRASH_LOOP_EXITS){
+        printf("Task %s is crash looping, holding off for %ums\n", t->config->name, RESTART_DELAY_MAX_MS);
+        delay = RESTART_DELAY_MAX_MS;
+        t->crashWindowExits = 0;
+        t->crashWindowStart = now + delay;
+    }
+
+    /* Jitter of +-25% so tasks that died together do not restart together */
+    delay = delay - delay / 4 + (unsigned int)(rand() % (delay / 2 + 1));
+
+    t->restartAt = now + delay;
+}
+
+/* Starts every task whose restart is due and returns the poll timeout until the next one */
+static int runRestarts(){
+    uint64_t now = nowMs();
+    int timeout = 60000;
+
+    for(unsigned int i=0; i<taskSlots; i++){
+        struct task* t = tasks[i];
+        if(t == NULL || !t->restartAt){
+            continue;
+        }
+
+        if(t->restartAt <= now){
+            runTask(t);
+            t = tasks[i];
+            if(t == NULL){
+                continue;
+            }
+        }
+
+        if(t->restartAt){
+            uint64_t remaining = t->restartAt > now ? t->restartAt - now : 0;
+            if(remaining < timeout){
+                timeout = remaining;
+            }
+        }
+    }
+
+    return timeout;
 }
 
 static void stateChange(Child* child, void* param, enum childStates state){
     struct task* t = (struct task*)param;
     
-    if(state == 2){
+    if(state == CHILD_TERMINATED){
         libChildFreeHandle(child);
-        sleep(1);
+        t->child = NULL;
 
-        if(t->restart && !taskShutdown){
-            runTask(t);
+        if(t->starting){
+            t->endedWhileStarting = 1;
         }else{
-            activeTasks[t->taskId] = NULL;
-            free(t);
+            taskEnded(t);
         }
     }
 }
 
+/* The child of the task is gone: free, replace or restart the task */
+static void taskEnded(struct task* t){
+    if(taskShutdown || t->removed){
+        freeTask(t);
+    }else if(t->replacement){
+        configFreeTask(t->config);
+        t->config = t->replacement;
+        t->replacement = NULL;
+        t->restartDelayMs = 0;
+        t->crashWindowExits = 0;
+        runTask(t);
+    }else if(t->config->restart){
+        scheduleRestart(t);
+    }else{
+        freeTask(t);
+    }
+}
+
 static void signalReceived(siginfo_t sig, void* param){
     if(sig.si_signo == SIGTERM){
         taskShutdown = 1;
+    }else if(sig.si_signo == SIGHUP){
+        reloadRequested = 1;
+    }
+}
+
+/* Sends the stop signal to every running task in a group, one message per distinct signal */
+static void stopGroup(unsigned int group, unsigned int graceMs){
+    Child** children = malloc(sizeof(Child*) * taskSlots);
+    if(!children){
+        return;
+    }
+
+    for(unsigned int i=0; i<taskSlots; i++){
+        struct task* t = tasks[i];
+        if(t == NULL || t->child == NULL || t->config->stopGroup != group || t->stopping){
+            continue;
+        }
+
+        int signalId = t->config->killSignal;
+        size_t count = 0;
+        for(unsigned int j=i; j<taskSlots; j++){
+            struct task* u = tasks[j];
+            if(u != NULL && u->child != NULL && u->config->stopGroup == group &&
+               !u->stopping && u->config->killSignal == signalId){
+                u->stopping = 1;
+                children[count++] = u->child;
+            }
+        }
+
+        libChildTerminateMany(lib, children, count, signalId, graceMs, SIGKILL);
+    }
+
+    free(children);
+}
+
+/* Returns the lowest stop group that still has a running task, -1 when none are left */
+static int64_t firstRunningGroup(){
+    int64_t group = -1;
+
+    for(unsigned int i=0; i<taskSlots; i++){
+        struct task* t = tasks[i];
+        if(t != NULL && t->child != NULL && (group < 0 || t->config->stopGroup < group)){
+            group = t->config->stopGroup;
+        }
+    }
+
+    return group;
+}
+
+static int runningTasks(){
+    int running = 0;
+
+    for(unsigned int i=0; i<taskSlots; i++){
+        if(tasks[i] != NULL && tasks[i]->child != NULL){
+            running++;
+        }
+    }
+
+    return running;
+}
+
+static struct task* findTask(const char* name){
+    for(unsigned int i=0; i<taskSlots; i++){
+        if(tasks[i] != NULL && !strcmp(tasks[i]->config->name, name)){
+            return tasks[i];
+        }
     }
+
+    return NULL;
 }
 
-int newTask(char* program, char* username, char** argv, char** env, int restart){
+int newTask(struct taskConfig* config, unsigned int generation){
     struct task* t = (struct task*)malloc(sizeof(struct task));
     if(!t){
         return -1;
@@ -64,25 +334,12 @@ int newTask(char* program, char* username, char** argv, char** env, int restart)
     
     memset(t, 0, sizeof(*t));
 
-    t->taskId=-1;
-
-    for(int i=0; i<sizeof(activeTasks)/sizeof(struct task*); i++){
-        if(activeTasks[i] == NULL){
-            activeTasks[i] = t;
-            t->taskId = i;
-            break;
-        }
-    }
-
-    if(t->taskId < 0){
+    if(allocSlot(t)){
         goto failed;
     }
 
-    t->program = program;
-    t->username = username;
-    t->argv = argv;
-    t->env = env;
-    t->restart = restart;
+    t->config = config;
+    t->generation = generation;
 
     runTask(t);
 
@@ -93,7 +350,82 @@ failed:
     return -1;
 }
 
+/* Makes the running tasks match the config: unchanged tasks are left alone */
+static void applyConfig(struct taskConfig* config){
+    static unsigned int generation = 0;
+    generation++;
+
+    while(config){
+        struct taskConfig* next = config->next;
+        config->next = NULL;
+
+        struct task* t = findTask(config->name);
+        if(!t){
+            if(newTask(config, generation)){
+                fprintf(stderr, "Failed to add task %s\n", config->name);
+                configFreeTask(config);
+            }
+        }else{
+            t->generation = generation;
+
+            if(!t->removed && !t->replacement && configEqual(t->config, config)){
+                configFreeTask(config);
+            }else if(t->replacement && configEqual(t->replacement, config)){
+                /* Already stopping to make room for this one */
+                configFreeTask(config);
+            }else if(t->removed && configEqual(t->config, config)){
+                /* Added back while it was being removed: it was stopped already, start it again
+                 * once it is gone instead of stopping it once more */
+                t->removed = 0;
+                t->replacement = config;
+            }else if(!t->child){
+                /* Waiting for a restart, swap it right away */
+                configFreeTask(t->config);
+                t->config = config;
+                t->restartDelayMs = 0;
+                t->crashWindowExits = 0;
+                runTask(t);
+            }else{
+                if(t->replacement){
+                    configFreeTask(t->replacement);
+                }
+                t->replacement = config;
+                t->removed = 0;
+                stopTask(t);
+            }
+        }
+
+        config = next;
+    }
+
+    for(unsigned int i=0; i<taskSlots; i++){
+        struct task* t = tasks[i];
+        if(t == NULL || t->generation == generation){
+            continue;
+        }
+
+        if(t->child){
+            t->removed = 1;
+            stopTask(t);
+        }else{
+            freeTask(t);
+        }
+    }
+}
+
+static int loadConfig(const char* path){
+    struct taskConfig* config = NULL;
+    if(configLoad(path, &config)){
+        return -1;
+    }
+
+    applyConfig(config);
+    return 0;
+}
+
 int main(int argc, char** argv){
+    const char* configPath = argc > 1 ? argv[1] : DEFAULT_CONFIG;
+
     if(getpid() == 1){
         lib = libChildInPlace(signalReceived, NULL);
     }else{
@@ -104,17 +436,29 @@ int main(int argc, char** argv){
         return -1;
     }
 
-    char* emptyPack[] = {NULL};
-    newTask("/tmp/a.sh", NULL, emptyPack, __environ, 1); 
+    srand(getpid() ^ nowMs());
+
+    if(loadConfig(configPath)){
+        libChildTerminateWorker(lib);
+        return -1;
+    }
 
     const unsigned int LIBCHILDFD = 0;
 
     while(!taskShutdown){
+        if(reloadRequested){
+            reloadRequested = 0;
+            printf("Reloading %s\n", configPath);
+            if(loadConfig(configPath)){
+                fprintf(stderr, "Keeping the current tasks\n");
+            }
+        }
+
         struct pollfd fds[1];
         fds[LIBCHILDFD].fd = libChildGetFd(lib);
         fds[LIBCHILDFD].events = POLLIN; 
 
-        int retVal = poll(fds, 1, 60000);
+        int retVal = poll(fds, 1, runRestarts());
         if(retVal < 0){
             if(errno == EINTR){
                 continue;
@@ -131,23 +475,33 @@ int main(int argc, char** argv){
         }
     }
 
-    printf("Sending SIGTERM to all active tasks\n");
-    for(int i=0; i<sizeof(activeTasks)/sizeof(struct task*); i++){
-        if(activeTasks[i] != NULL){
-            libChildKill(activeTasks[i]->child, SIGTERM);
-        }
-    }
-    sleep(5);
-    libChildPoll(lib);
+    printf("Stopping all active tasks\n");
+
+    /* Groups are stopped in order but share one deadline, after which the worker sends SIGKILL */
+    uint64_t deadline = nowMs() + SHUTDOWN_TIMEOUT_MS;
+    int64_t group;
+    while((group = firstRunningGroup()) >= 0){
+        uint64_t now = nowMs();
+        unsigned int remaining = deadline > now ? deadline - now : 0;
+
+        stopGroup(group, remaining);
 
-    printf("Sending SIGKILL to all remaining tasks\n");
-    for(int i=0; i<sizeof(activeTasks)/sizeof(struct task*); i++){
-        if(activeTasks[i] != NULL){
-            libChildKill(activeTasks[i]->child, SIGKILL);
+        struct pollfd fds[1];
+        fds[LIBCHILDFD].fd = libChildGetFd(lib);
+        fds[LIBCHILDFD].events = POLLIN;
+
+        int retVal = poll(fds, 1, remaining + 1000);
+        if(retVal < 0 && errno != EINTR){
+            break;
+        }
+        if(retVal == 0 && !remaining){
+            fprintf(stderr, "%d tasks did not stop in time\n", runningTasks());
+            break;
+        }
+        if(libChildPoll(lib)){
+            break;
         }
     }
-    sleep(2);
-    libChildPoll(lib);
 
     libChildTerminateWorker(lib);
     return 0;
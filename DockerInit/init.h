@@ -1,5 +1,28 @@
 #ifndef _INIT_H
 #define _INIT_H
 
+/* One supervised task as described by the config file */
+struct taskConfig {
+    struct taskConfig* next;
+    char* name;
+    char* program;
+    char* username;
+    char** argv;
+    /* NULL means the task inherits the environment of docker-init */
+    char** env;
+    int restart;
+    unsigned int deadlineMs;
+    int killSignal;
+    unsigned int killGraceMs;
+    /* On shutdown lower groups are stopped first, each group waits for the previous one */
+    unsigned int stopGroup;
+    /* childExecFlags, set by process_group=yes or process_group=session */
+    unsigned int execFlags;
+};
+
+int configLoad(const char* path, struct taskConfig** result);
+int configEqual(struct taskConfig* a, struct taskConfig* b);
+void configFreeTask(struct taskConfig* config);
+void configFree(struct taskConfig* config);
 
 #endif
@@ -0,0 +1,397 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libchild.h"
+
+/* Microbenchmarks for libchild, results are written as JSON to stdout */
+
+static int quick = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compareU64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t* samples, unsigned int count, double p)
+{
+    if(!count) return 0;
+
+    unsigned int index = (unsigned int)(p * (count - 1) + 0.5);
+    return samples[index];
+}
+
+static void printLatency(const char* name, uint64_t* samples, unsigned int count)
+{
+    qsort(samples, count, sizeof(uint64_t), compareU64);
+
+    printf("    \"%s\": {\"samples\": %u, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+           name, count,
+           (unsigned long long)percentile(samples, count, 0.50),
+           (unsigned long long)percentile(samples, count, 0.99),
+           (unsigned long long)(count ? samples[count - 1] : 0));
+}
+
+/* Full path of a program on PATH, the worker does not search */
+static char* findProgram(const char* name)
+{
+    static char path[4096];
+
+    const char* dirs = getenv("PATH");
+    if(!dirs) {
+        dirs = "/usr/bin:/bin";
+    }
+
+    while(*dirs) {
+        size_t len = strcspn(dirs, ":");
+        if(len && len + strlen(name) + 2 <= sizeof(path)) {
+            memcpy(path, dirs, len);
+            path[len] = '/';
+            strcpy(path + len + 1, name);
+            if(!access(path, X_OK)) {
+                return path;
+            }
+        }
+        dirs += len;
+        if(*dirs) {
+            dirs++;
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait for the worker, returns -1 if it died */
+static int pump(LibChild* lib, int timeoutMs)
+{
+    struct pollfd fds[1];
+    fds[0].fd = libChildGetFd(lib);
+    fds[0].events = POLLIN;
+
+    int retVal = poll(fds, 1, timeoutMs);
+    if(retVal < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    if(retVal > 0) {
+        return libChildPoll(lib);
+    }
+
+    return 0;
+}
+
+struct job {
+    uint64_t submitted;
+    uint64_t started;
+    uint64_t terminated;
+    int      done;
+    size_t   bytes;
+};
+
+static unsigned int jobsRunning = 0;
+
+static void jobState(Child* child, void* param, enum childStates state)
+{
+    struct job* j = (struct job*)param;
+
+    if(state == CHILD_STARTED) {
+        j->started = now();
+    } else if(state == CHILD_TERMINATED) {
+        j->terminated = now();
+        j->done = 1;
+        jobsRunning--;
+
+        /* Nothing looks at the handle after it terminated */
+        libChildFreeHandle(child);
+    }
+}
+
+static void jobData(Child* child, void* param, char* buffer, size_t len, int isErr)
+{
+    struct job* j = (struct job*)param;
+    j->bytes += len;
+}
+
+static char* emptyPack[] = {NULL};
+
+static Child* submit(LibChild* lib, char* program, char** argv, struct job* j, int withOutput)
+{
+    memset(j, 0, sizeof(*j));
+    j->submitted = now();
+    jobsRunning++;
+
+    Child* child = libChildExec(lib, program, NULL, argv, emptyPack, jobState, withOutput ? jobData : NULL, j);
+    if(!child) {
+        jobsRunning--;
+    }
+
+    return child;
+}
+
+static void benchSpawn(LibChild* lib)
+{
+    unsigned int iterations = quick ? 200 : 2000;
+    uint64_t* started = calloc(iterations, sizeof(uint64_t));
+    uint64_t* roundTrip = calloc(iterations, sizeof(uint64_t));
+    char* argv[] = {"true", NULL};
+    unsigned int count = 0;
+
+    for(unsigned int i = 0; i < iterations; i++) {
+        struct job j;
+        Child* child = submit(lib, "/bin/true", argv, &j, 0);
+        if(!child) break;
+
+        while(!j.done) {
+            if(pump(lib, -1)) break;
+        }
+
+        started[count] = j.started - j.submitted;
+        roundTrip[count] = j.terminated - j.submitted;
+        count++;
+    }
+
+    printLatency("spawn_to_started", started, count);
+    printf(",\n");
+    printLatency("spawn_round_trip", roundTrip, count);
+    printf(",\n");
+
+    free(started);
+    free(roundTrip);
+}
+
+static void benchThroughput(LibChild* lib)
+{
+    unsigned int total = quick ? 500 : 5000;
+    const unsigned int inFlight = 64;
+    struct job* jobs = calloc(total, sizeof(struct job));
+    char* argv[] = {"true", NULL};
+    unsigned int submitted = 0;
+    unsigned int failed = 0;
+
+    uint64_t start = now();
+    while(submitted < total || jobsRunning) {
+        while(submitted < total && jobsRunning < inFlight) {
+            if(!submit(lib, "/bin/true", argv, &jobs[submitted], 0)) {
+                failed++;
+            }
+            submitted++;
+        }
+        if(pump(lib, -1)) break;
+    }
+    double seconds = (now() - start) / 1e9;
+
+    printf("    \"exec_throughput\": {\"jobs\": %u, \"in_flight\": %u, \"failed\": %u, \"seconds\": %.6f, \"jobs_per_second\": %.1f},\n",
+           total, inFlight, failed, seconds, (total - failed) / seconds);
+
+    free(jobs);
+}
+
+static void benchOutput(LibChild* lib, const char* name, enum childDataModes mode)
+{
+    uint64_t duration = (quick ? 500 : 3000) * 1000000ULL;
+    char* argv[] = {"yes", NULL};
+    struct job j;
+
+    libChildSetDataMode(lib, mode);
+
+    char* program = findProgram("yes");
+    Child* child = program ? submit(lib, program, argv, &j, 1) : NULL;
+    if(!child) {
+        printf("    \"%s\": null,\n", name);
+        return;
+    }
+
+    uint64_t start = now();
+    while(now() - start < duration) {
+        if(pump(lib, 100)) break;
+    }
+    size_t bytes = j.bytes;
+    double seconds = (now() - start) / 1e9;
+
+    libChildKill(child, SIGKILL);
+    while(!j.done) {
+        if(pump(lib, -1)) break;
+    }
+    libChildSetDataMode(lib, CHILD_DATA_COPY);
+
+    printf("    \"%s\": {\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_second\": %.1f},\n",
+           name, bytes, seconds, bytes / seconds / 1e6);
+}
+
+static volatile uint64_t signalArrived = 0;
+
+static void signalReceived(siginfo_t sig, void* param)
+{
+    if(sig.si_signo == SIGUSR1) {
+        signalArrived = now();
+    }
+}
+
+static void benchSignal(LibChild* lib)
+{
+    unsigned int iterations = quick ? 200 : 2000;
+    uint64_t* samples = calloc(iterations, sizeof(uint64_t));
+    unsigned int count = 0;
+
+    for(unsigned int i = 0; i < iterations; i++) {
+        signalArrived = 0;
+        uint64_t sent = now();
+        if(kill(libChildWorkerPid(lib), SIGUSR1)) break;
+
+        while(!signalArrived) {
+            if(pump(lib, 1000)) break;
+        }
+        if(!signalArrived) break;
+
+        samples[count++] = signalArrived - sent;
+    }
+
+    printLatency("signal_forwarding", samples, count);
+    printf(",\n");
+
+    free(samples);
+}
+
+static void benchScale(LibChild* lib, unsigned int children, int last)
+{
+    struct job* jobs = calloc(children, sizeof(struct job));
+    Child** handles = calloc(children, sizeof(Child*));
+    char* argv[] = {"sleep", "3600", NULL};
+    unsigned int spawned = 0;
+
+    uint64_t start = now();
+    for(unsigned int i = 0; i < children; i++) {
+        handles[i] = submit(lib, "/bin/sleep", argv, &jobs[i], 0);
+        if(handles[i]) spawned++;
+    }
+
+    /* Wait until everything reported CHILD_STARTED (or died already) */
+    unsigned int started;
+    do {
+        started = 0;
+        for(unsigned int i = 0; i < children; i++) {
+            if(handles[i] && (jobs[i].started || jobs[i].done)) started++;
+        }
+        if(started < spawned && pump(lib, 1000)) break;
+    } while(started < spawned);
+    double startSeconds = (now() - start) / 1e9;
+
+    start = now();
+    for(unsigned int i = 0; i < children; i++) {
+        if(handles[i] && !jobs[i].done) {
+            libChildKill(handles[i], SIGKILL);
+        }
+    }
+    while(jobsRunning) {
+        if(pump(lib, 1000)) break;
+    }
+    double stopSeconds = (now() - start) / 1e9;
+
+    printf("      {\"children\": %u, \"spawned\": %u, \"start_seconds\": %.6f, \"stop_seconds\": %.6f}%s\n",
+           children, spawned, startSeconds, stopSeconds, last ? "" : ",");
+
+    free(jobs);
+    free(handles);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int scales[] = {10, 1000, 10000};
+    unsigned int numScales = sizeof(scales) / sizeof(scales[0]);
+
+    int opt;
+    while((opt = getopt(argc, argv, "qs:")) != -1) {
+        if(opt == 'q') {
+            quick = 1;
+        } else if(opt == 's') {
+            /* Largest scale to run */
+            unsigned int max = atoi(optarg);
+            while(numScales > 1 && scales[numScales - 1] > max) numScales--;
+        } else {
+            fprintf(stderr, "Usage: %s [-q] [-s maxChildren]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    LibChild* lib = libChildCreateWorker("libchild-bench-worker", NULL, signalReceived, NULL);
+    if(!lib) {
+        fprintf(stderr, "Failed to create worker\n");
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"benchmark\": \"libchild\",\n");
+    printf("  \"quick\": %s,\n", quick ? "true" : "false");
+    printf("  \"results\": {\n");
+
+    benchSpawn(lib);
+    benchThroughput(lib);
+    benchOutput(lib, "stdout_throughput_copy", CHILD_DATA_COPY);
+    benchOutput(lib, "stdout_throughput_zerocopy", CHILD_DATA_ZEROCOPY);
+    benchSignal(lib);
+
+    printf("    \"scale\": [\n");
+    for(unsigned int i = 0; i < numScales; i++) {
+        benchScale(lib, scales[i], i == numScales - 1);
+    }
+    printf("    ],\n");
+
+    struct libChildStats stats;
+    if(!libChildGetStats(lib, &stats)) {
+        printf("    \"stats\": {\"spawns\": %llu, \"spawn_failures\": %llu, \"frames_sent\": %llu, \"frames_received\": %llu, "
+               "\"write_stalls\": %llu, \"worker_wakeups\": %llu, \"spawn_to_started_p99_ns\": %llu, \"exit_to_notified_p99_ns\": %llu}\n",
+               stats.spawns, stats.spawnFailures, stats.framesSent, stats.framesReceived,
+               stats.writeStalls, stats.workerWakeups,
+               libChildHistogramPercentile(&stats.spawnToStarted, 99),
+               libChildHistogramPercentile(&stats.exitToNotified, 99));
+    } else {
+        printf("    \"stats\": null\n");
+    }
+
+    printf("  }\n");
+    printf("}\n");
+
+    libChildTerminateWorker(lib);
+    return 0;
+}
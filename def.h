@@ -27,9 +27,14 @@
 #ifndef LIBCHILD_H_
 #define LIBCHILD_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libchild.h"
+#include "trace.h"
 
 struct slaveCommand {
     int     command;
@@ -38,20 +43,176 @@ struct slaveCommand {
     int     paramInteger;
 };
 
+/* Marker byte on the command socket that carries file descriptors */
+struct txAttachment {
+    size_t  offset;
+    int     fds[3];
+    unsigned int count;
+};
+
+struct slaveExecOptions {
+    unsigned int flags;
+    unsigned int deadlineMs;
+    int     killSignal;
+    unsigned int killGraceMs;
+    int     finalSignal;
+    /* Bit n set: the fd for stdio stream n follows the options with SCM_RIGHTS, in stream order */
+    unsigned int stdioFds;
+    /* A slaveFilter and its pattern pack follow */
+    unsigned int filter;
+    /* Size of the tail ring per stream, 0 to send output as it comes */
+    unsigned int tailBytes;
+    /* Admission, see childExecOptions */
+    int     priority;
+    unsigned int tag;
+    unsigned int outputWeight;
+};
+
+/* Payload of SLAVE_COMMAND_SET_LIMITS, 0 for no limit */
+struct slaveLimits {
+    unsigned int maxRunning;
+    unsigned int maxPerUser;
+    unsigned int maxPerTag;
+};
+
+struct slaveFilter {
+    unsigned int sampleEvery;
+    unsigned long long byteCap;
+};
+
+struct slaveTerminate {
+    int     signal;
+    unsigned int graceMs;
+    int     finalSignal;
+};
+
+/* Counters of a child summed over its processes, see SLAVE_RESULT_USAGE */
+struct slaveUsage {
+    uint64_t cpuNs;
+    uint64_t readBytes;
+    uint64_t writeBytes;
+    uint64_t majorFaults;
+    uint64_t rssBytes;
+    uint32_t threads;
+};
+
+/* The counters are what was added since the previous record of the child, rssBytes and threads are current */
+struct slaveUsageRecord {
+    void*   masterEcho;
+    struct slaveUsage usage;
+};
+
+/* paramInteger of SLAVE_COMMAND_TERMINATE_MANY: ignore the list and terminate every child */
+#define SLAVE_TERMINATE_ALL 1
+
 struct slaveResponse {
     void*   masterEcho;
     int     result;
     void*   paramChildProcess;
     int     paramInteger;
+    /* CLOCK_MONOTONIC ns of what caused the frame: a read, reap, fork, signal or command */
+    uint64_t timestamp;
+};
+
+struct objectPool {
+    size_t  objectSize;
+    unsigned int perSlab;
+    void*   freeList;
+    void*   slabs;
+    struct libChildPoolStats stats;
+};
+
+/* Bump allocator for everything decoded from one message, reset keeps the memory for the next */
+struct arenaChunk;
+struct arenaMap;
+struct arena {
+    struct arena* next;
+    struct arenaChunk* chunks;
+    size_t  capacity;
+    /* Mappings that go away with the contents */
+    struct arenaMap* maps;
+};
+
+/* Reference counted receive memory, childData payloads point into these */
+struct rxBlock {
+    unsigned int refs;
+    size_t  size;
+    char    data[];
+};
+
+struct rxBuffer {
+    struct rxBlock* block;
+    size_t  start;
+    size_t  end;
+    /* Descriptors that came with the data, until their marker bytes are decoded */
+    int*    fds;
+    unsigned int fdCount;
+    unsigned int fdSize;
+};
+
+/* An event of CHILD_DATA_EVENTS mode, holding a reference to the receive memory it points into */
+struct queuedEvent {
+    struct libChildEvent event;
+    struct rxBlock* block;
 };
 
 struct LibChild {
     pid_t   intermediatePid;
+    /* Where signals for the worker go, -1 when it is not ours */
+    pid_t   workerPid;
     int     workerDied;
     int     unusedHandle;
+    int     terminated;
     int     sockets[2];
     void    (*signalReceived)(siginfo_t signal, void* param);
     void*   param;
+    void    (*usageSampled)(struct Child* child, void* param, const struct childUsage* usage);
+
+    struct objectPool childPool;
+    struct rxBuffer   rx;
+    struct rxBlock*   arena;
+    struct rxBlock*   deliverBlock;
+    enum childDataModes dataMode;
+
+    /* Outgoing messages, queued whole so nested writes cannot interleave */
+    char*   tx;
+    size_t  txStart;
+    size_t  txEnd;
+    size_t  txSize;
+
+    /* File descriptors that go out with a byte of tx, in queue order */
+    struct txAttachment* txAttach;
+    unsigned int txAttachCount;
+    unsigned int txAttachSent;
+    unsigned int txAttachSize;
+
+    /* Master half of the statistics, libChildGetStats merges in the worker half */
+    struct libChildStats stats;
+    struct libChildStats* statsRequest;
+    int     statsReceived;
+
+    struct traceRing trace;
+    int     traceDumpFd;
+    int     traceReceived;
+
+    /* Events not yet handed out by libChildPollEvents */
+    struct queuedEvent* events;
+    size_t  eventHead;
+    size_t  eventCount;
+    size_t  eventSize;
+    /* Called for every child found by libChildAttach */
+    void    (*adopt)(struct Child* child, void* param);
+    int     listenResult;
+    int     listenReceived;
+    int     snapshotReceived;
+
+    /* Worker timestamp of the frame being handled, 0 outside of one */
+    uint64_t frameTime;
+
+    /* Receive memory of the events handed out last time */
+    struct rxBlock** heldBlocks;
+    size_t  heldCount;
+    size_t  heldSize;
 };
 
 typedef struct LibChild LibChild;
@@ -66,8 +227,33 @@ struct Child {
     LibChild* lib;
     unsigned int unusedHandle;
     int exitStatus;
+    uint64_t submitted;
+    struct slaveTerminate pendingTerminate;
+    int hasPendingTerminate;
+    /* A libChildKill before the worker knew the child, separate so it cannot replace a terminate */
+    int pendingKill;
+    int hasPendingKill;
+    int* stageStatus;
+    unsigned int stageCount;
+    struct childFilterStats filterStats;
+    int hasFilterStats;
+    struct childUsage usage;
+    int hasUsage;
 };
 
+/* Upper limit for the number of stages in a pipeline */
+#define PIPELINE_MAX_STAGES 64
+
+/* Upper limit for the states of an output filter, one per pattern byte plus the root. Each
+ * child with a filter costs a table of 512 bytes per state, unless its patterns are shared. */
+#define FILTER_MAX_STATES 4096
+
+/* Upper limit for childExecOptions.tailBytes, both rings have to fit in one frame */
+#define TAIL_MAX_BYTES (16 * 1024 * 1024)
+
+/* Upper limit for any length in a command, the worker drops a client that sends more */
+#define COMMAND_MAX_BYTES (64 * 1024 * 1024)
+
 typedef struct Child Child;
 
 enum slaveCommands {
@@ -76,6 +262,20 @@ enum slaveCommands {
     SLAVE_COMMAND_KILL = 3,
     SLAVE_COMMAND_EXEC_PIPE = 4,
     SLAVE_COMMAND_QUIT = 5,
+    SLAVE_COMMAND_GET_STATS = 6,
+    SLAVE_COMMAND_TRACE = 7,
+    SLAVE_COMMAND_TRACE_DUMP = 8,
+    SLAVE_COMMAND_TERMINATE = 9,
+    SLAVE_COMMAND_TERMINATE_MANY = 10,
+    SLAVE_COMMAND_EXEC_PIPELINE = 11,
+    SLAVE_COMMAND_FETCH_TAIL = 12,
+    SLAVE_COMMAND_LISTEN = 13,
+    /* First command on a connection to the listening socket */
+    SLAVE_COMMAND_ATTACH = 14,
+    SLAVE_COMMAND_ADOPT = 15,
+    SLAVE_COMMAND_SET_LIMITS = 16,
+    /* paramInteger is the interval in ms, 0 stops sampling */
+    SLAVE_COMMAND_SET_SAMPLING = 17,
 };
 
 enum slaveResults {
@@ -84,18 +284,143 @@ enum slaveResults {
     SLAVE_RESULT_CHILD_DIED = 2,
     SLAVE_RESULT_CHILD_STDOUT_DATA = 3,
     SLAVE_RESULT_CHILD_STDERR_DATA = 4,
-    SLAVE_RESULT_GOT_SIGNAL = 5
+    SLAVE_RESULT_GOT_SIGNAL = 5,
+    SLAVE_RESULT_STATS = 6,
+    SLAVE_RESULT_TRACE = 7,
+    /* Exit status of every pipeline stage, sent right before SLAVE_RESULT_CHILD_DIED */
+    SLAVE_RESULT_PIPELINE_STATUS = 8,
+    /* struct childFilterStats, sent right before SLAVE_RESULT_CHILD_DIED */
+    SLAVE_RESULT_FILTER_STATS = 9,
+    /* Contents of the tail rings, paramInteger bytes of stdout followed by stderr */
+    SLAVE_RESULT_TAIL = 10,
+    /* paramInteger is 0 or an errno value */
+    SLAVE_RESULT_LISTENING = 11,
+    /* Array of slaveSnapshotEntry, nothing else is sent until SLAVE_COMMAND_ADOPT */
+    SLAVE_RESULT_SNAPSHOT = 12,
+    /* Instead of SLAVE_RESULT_CHILD_CREATED when a limit is reached, that follows once it runs */
+    SLAVE_RESULT_CHILD_QUEUED = 13,
+    /* Array of slaveUsageRecord, one per child that changed since the previous sample */
+    SLAVE_RESULT_USAGE = 14
+};
+
+struct slaveSnapshotEntry {
+    void*   slaveId;
+    int     pid;
+};
+
+/* Payload of SLAVE_COMMAND_ADOPT, the new masterEcho of every child */
+struct slaveAdoptEntry {
+    void*   slaveId;
+    void*   masterEcho;
 };
 
 void libChildSlaveProcess(int socket);
-int libChildReadFull(int fd, char* buffer, size_t len, int unblock);
+void libChildSlaveServer(const char* path, unsigned int maxClients, unsigned int maxChildren,
+                         const struct slaveLimits* limits);
+int libChildReadFull(struct rxBuffer* rx, char* buffer, size_t len);
 int libChildWriteFull(struct LibChild* lib, int fd, char* buffer, size_t len);
+int libChildFlush(struct LibChild* lib);
 int libChildWriteVariable(struct LibChild* lib, int fd, void* buf, unsigned int len);
-char* libChildReadVariable(int fd, unsigned int* readLen);
+char* libChildReadVariable(struct rxBuffer* rx, unsigned int* readLen);
+char* libChildReadVariableArena(struct rxBuffer* rx, struct arena* arena);
+int libChildReadStruct(struct rxBuffer* rx, void* buf, unsigned int len);
+int libChildQueueFds(struct LibChild* lib, int* fds, unsigned int count);
+int libChildReadFds(struct rxBuffer* rx, int* fds, unsigned int count);
+void libChildDropFds(struct LibChild* lib);
+void libChildTxRollback(struct LibChild* lib, size_t mark);
+/* Packs of at least this many bytes go as a sealed memfd, the count then has PACK_MEMFD_FLAG set */
+#define PACK_MEMFD_BYTES (64 * 1024)
+#define PACK_MEMFD_FLAG  0x80000000u
 int libChildWritePack(struct LibChild* lib, int fd, char** arg);
-void libChildFreePack(char** arg);
-char** libChildReadPack(int fd);
+char** libChildReadPack(struct rxBuffer* rx, struct arena* arena);
+
+struct userCredentials {
+    struct userCredentials* next;
+    char*   username;
+    time_t  resolved;
+    int     found;
+    uid_t   uid;
+    gid_t   gid;
+    int     numGroups;
+    gid_t*  groups;
+};
+
+int   rxBlockReserve(struct rxBlock** block, size_t size);
+void  rxBlockRelease(struct rxBlock* block);
+int   rxFill(struct rxBuffer* rx, int fd, size_t wanted);
+char* rxPeek(struct rxBuffer* rx, size_t len);
+void  rxConsume(struct rxBuffer* rx, size_t len);
+int   rxTakeFds(struct rxBuffer* rx, int* fds, unsigned int count);
+void  rxFree(struct rxBuffer* rx);
+
+#define CONTAINER_OF(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+struct timerEntry {
+    uint64_t expires;
+    unsigned int index;
+    void    (*expired)(struct timerEntry* entry);
+};
+
+struct timerHeap {
+    struct timerEntry** entries;
+    unsigned int count;
+    unsigned int size;
+};
+
+int   timerArm(struct timerHeap* heap, struct timerEntry* entry, uint64_t expires);
+void  timerCancel(struct timerHeap* heap, struct timerEntry* entry);
+int   timerTimeout(struct timerHeap* heap, uint64_t now);
+void  timerRun(struct timerHeap* heap, uint64_t now);
+
+/* Line filter on child output, see filter.c */
+struct outputFilter;
+
+struct filterStream {
+    unsigned int state;
+    int     matched;
+    char*   line;
+    size_t  lineLen;
+    size_t  lineSize;
+    /* Bytes of the current line that were not kept */
+    size_t  lineDropped;
+};
+
+struct filterState {
+    struct outputFilter* filter;
+    unsigned int sampleEvery;
+    unsigned long long byteCap;
+    int     capped;
+    struct filterStream streams[2];
+    unsigned long long matchedLines;
+    struct childFilterStats stats;
+};
+
+struct filterOutput {
+    char*   data;
+    size_t  len;
+    size_t  size;
+};
+
+struct filterState* filterCreate(char** patterns, struct slaveFilter* settings);
+void  filterDestroy(struct filterState* state);
+int   filterFeed(struct filterState* state, int stream, const char* data, size_t len, struct filterOutput* out);
+int   filterFinish(struct filterState* state, int stream, struct filterOutput* out);
+
+uint64_t libChildNow();
+void  histogramRecord(struct libChildHistogram* histogram, uint64_t value);
+
+void  poolInit(struct objectPool* pool, size_t objectSize, unsigned int perSlab);
+void* poolAlloc(struct objectPool* pool);
+void  poolFree(struct objectPool* pool, void* object);
+void  poolDestroy(struct objectPool* pool);
+void  arenaInit(struct arena* arena);
+void* arenaAlloc(struct arena* arena, size_t size);
+int   arenaAddMap(struct arena* arena, void* map, size_t len);
+void  arenaReset(struct arena* arena);
+void  arenaDestroy(struct arena* arena);
 
 int changeUser(char* username);
+struct userCredentials* lookupUser(char* username);
+int applyUser(struct userCredentials* cred);
 
 #endif /* LIBCHILD_H_ */
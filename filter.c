@@ -0,0 +1,355 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "def.h"
+
+/* Output filter for the worker. Patterns are compiled into an Aho-Corasick automaton that is
+ * expanded into a full transition table, so scanning costs one table lookup per byte and no
+ * backtracking, for any number of patterns. Lines are split with memchr and a line is not
+ * scanned any further once it has matched. The automaton state is kept per stream, so a match
+ * split over two reads is still found. Children with the same patterns share one table. */
+
+/* Longer lines are cut, the rest is still scanned and counted as dropped */
+#define FILTER_LINE_MAX     (64 * 1024)
+
+#define NO_STATE 0xFFFF
+
+struct outputFilter {
+    uint16_t* next;
+    uint8_t*  accept;
+    unsigned int states;
+    int       matchAll;
+    /* The patterns it was built from, each NUL terminated, to find it again */
+    char*     key;
+    size_t    keyLen;
+    unsigned int refs;
+    struct outputFilter* nextCompiled;
+};
+
+/* Compiled filters in use by at least one child */
+static struct outputFilter* compiledFilters;
+
+static int filterCompile(struct outputFilter* filter, char** patterns)
+{
+    size_t total = 1;
+    for(char** it = patterns; it && *it; it++) {
+        if(!**it) {
+            /* The empty string is in every line */
+            filter->matchAll = 1;
+            return 0;
+        }
+        total += strlen(*it);
+    }
+
+    if(total == 1) {
+        filter->matchAll = 1;
+        return 0;
+    }
+    if(total > FILTER_MAX_STATES) {
+        return -1;
+    }
+
+    filter->next = (uint16_t*)malloc(total * 256 * sizeof(uint16_t));
+    filter->accept = (uint8_t*)calloc(total, 1);
+    uint16_t* fail = (uint16_t*)malloc(total * sizeof(uint16_t));
+    uint16_t* queue = (uint16_t*)malloc(total * sizeof(uint16_t));
+    if(!filter->next || !filter->accept || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+
+    memset(filter->next, 0xFF, total * 256 * sizeof(uint16_t));
+    filter->states = 1;
+
+    /* Build the trie */
+    for(char** it = patterns; *it; it++) {
+        unsigned int state = 0;
+        for(const unsigned char* c = (const unsigned char*)*it; *c; c++) {
+            uint16_t* slot = &filter->next[state * 256 + *c];
+            if(*slot == NO_STATE) {
+                *slot = filter->states++;
+            }
+            state = *slot;
+        }
+        filter->accept[state] = 1;
+    }
+
+    /* Breadth first, fill in the missing transitions through the failure links */
+    unsigned int head = 0, tail = 0;
+    for(unsigned int c=0; c<256; c++) {
+        uint16_t* slot = &filter->next[c];
+        if(*slot == NO_STATE) {
+            *slot = 0;
+        } else {
+            fail[*slot] = 0;
+            queue[tail++] = *slot;
+        }
+    }
+
+    while(head < tail) {
+        unsigned int state = queue[head++];
+        for(unsigned int c=0; c<256; c++) {
+            uint16_t* slot = &filter->next[state * 256 + c];
+            uint16_t fallback = filter->next[fail[state] * 256 + c];
+            if(*slot == NO_STATE) {
+                *slot = fallback;
+            } else {
+                fail[*slot] = fallback;
+                filter->accept[*slot] |= filter->accept[fallback];
+                queue[tail++] = *slot;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+static void filterFree(struct outputFilter* filter)
+{
+    free(filter->next);
+    free(filter->accept);
+    free(filter->key);
+    free(filter);
+}
+
+/* Returns the compiled filter for these patterns, built only if no child uses it yet */
+static struct outputFilter* filterTake(char** patterns)
+{
+    size_t keyLen = 0;
+    for(char** it = patterns; it && *it; it++) {
+        keyLen += strlen(*it) + 1;
+    }
+
+    char* key = (char*)malloc(keyLen + 1);
+    if(!key) return NULL;
+
+    char* pos = key;
+    for(char** it = patterns; it && *it; it++) {
+        pos = stpcpy(pos, *it) + 1;
+    }
+
+    for(struct outputFilter* it = compiledFilters; it; it = it->nextCompiled) {
+        if(it->keyLen == keyLen && !memcmp(it->key, key, keyLen)) {
+            free(key);
+            it->refs++;
+            return it;
+        }
+    }
+
+    struct outputFilter* filter = (struct outputFilter*)calloc(1, sizeof(struct outputFilter));
+    if(!filter) {
+        free(key);
+        return NULL;
+    }
+    filter->key = key;
+    filter->keyLen = keyLen;
+
+    if(filterCompile(filter, patterns)) {
+        filterFree(filter);
+        return NULL;
+    }
+
+    filter->refs = 1;
+    filter->nextCompiled = compiledFilters;
+    compiledFilters = filter;
+    return filter;
+}
+
+static void filterRelease(struct outputFilter* filter)
+{
+    if(--filter->refs) return;
+
+    struct outputFilter** link = &compiledFilters;
+    while(*link != filter) {
+        link = &(*link)->nextCompiled;
+    }
+    *link = filter->nextCompiled;
+    filterFree(filter);
+}
+
+struct filterState* filterCreate(char** patterns, struct slaveFilter* settings)
+{
+    struct filterState* state = (struct filterState*)calloc(1, sizeof(struct filterState));
+    if(!state) return NULL;
+
+    state->filter = filterTake(patterns);
+    if(!state->filter) {
+        free(state);
+        return NULL;
+    }
+
+    state->sampleEvery = settings->sampleEvery;
+    state->byteCap = settings->byteCap;
+    return state;
+}
+
+void filterDestroy(struct filterState* state)
+{
+    if(!state) return;
+
+    filterRelease(state->filter);
+    free(state->streams[0].line);
+    free(state->streams[1].line);
+    free(state);
+}
+
+static int outputAppend(struct filterOutput* out, const char* data, size_t len)
+{
+    if(out->len + len > out->size) {
+        size_t newSize = out->size ? out->size : 4096;
+        while(newSize < out->len + len) {
+            newSize *= 2;
+        }
+
+        char* newData = realloc(out->data, newSize);
+        if(!newData) return -1;
+
+        out->data = newData;
+        out->size = newSize;
+    }
+
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+static int lineAppend(struct filterStream* stream, const char* data, size_t len)
+{
+    if(stream->lineLen + len > stream->lineSize) {
+        size_t newSize = stream->lineSize ? stream->lineSize : 256;
+        while(newSize < stream->lineLen + len) {
+            newSize *= 2;
+        }
+
+        char* newLine = realloc(stream->line, newSize);
+        if(!newLine) return -1;
+
+        stream->line = newLine;
+        stream->lineSize = newSize;
+    }
+
+    memcpy(stream->line + stream->lineLen, data, len);
+    stream->lineLen += len;
+    return 0;
+}
+
+static int lineEnd(struct filterState* state, struct filterStream* stream, struct filterOutput* out)
+{
+    struct outputFilter* filter = state->filter;
+    int forward = 0;
+
+    if(!state->capped && (stream->matched || filter->matchAll)) {
+        forward = (state->sampleEvery <= 1) || !(state->matchedLines % state->sampleEvery);
+        state->matchedLines++;
+
+        if(forward && state->byteCap && state->stats.bytesForwarded + stream->lineLen > state->byteCap) {
+            state->capped = 1;
+            forward = 0;
+        }
+    }
+
+    size_t lineBytes = stream->lineLen + stream->lineDropped;
+    if(forward) {
+        if(outputAppend(out, stream->line, stream->lineLen)) return -1;
+        state->stats.linesForwarded++;
+        state->stats.bytesForwarded += stream->lineLen;
+        state->stats.bytesDropped += stream->lineDropped;
+    } else {
+        state->stats.linesDropped++;
+        state->stats.bytesDropped += lineBytes;
+    }
+
+    stream->lineLen = 0;
+    stream->lineDropped = 0;
+    stream->matched = 0;
+    stream->state = 0;
+    return 0;
+}
+
+/* Appends the lines of data that pass the filter to out. Incomplete lines are kept for the next call. */
+int filterFeed(struct filterState* state, int stream, const char* data, size_t len, struct filterOutput* out)
+{
+    struct outputFilter* filter = state->filter;
+    struct filterStream* s = &state->streams[stream];
+
+    while(len) {
+        const char* newline = memchr(data, '\n', len);
+        size_t segment = newline ? (size_t)(newline - data) + 1 : len;
+
+        if(state->capped) {
+            /* Nothing goes out anymore, only count */
+            s->lineDropped += segment;
+        } else {
+            if(!s->matched && !filter->matchAll) {
+                const uint16_t* next = filter->next;
+                const uint8_t* accept = filter->accept;
+                unsigned int st = s->state;
+
+                for(size_t i=0; i<segment; i++) {
+                    st = next[st * 256 + (unsigned char)data[i]];
+                    if(accept[st]) {
+                        s->matched = 1;
+                        break;
+                    }
+                }
+                s->state = st;
+            }
+
+            /* A long line is cut, but keeps room for its newline so it does not run into the next one */
+            size_t text = newline ? segment - 1 : segment;
+            size_t keep = text;
+            if(s->lineLen + keep > FILTER_LINE_MAX - 1) {
+                keep = FILTER_LINE_MAX - 1 - s->lineLen;
+            }
+            if(lineAppend(s, data, keep)) return -1;
+            if(newline && lineAppend(s, "\n", 1)) return -1;
+            s->lineDropped += text - keep;
+        }
+
+        if(newline) {
+            if(lineEnd(state, s, out)) return -1;
+        }
+
+        data += segment;
+        len -= segment;
+    }
+
+    return 0;
+}
+
+/* The stream was closed, decides on the last line even without a newline */
+int filterFinish(struct filterState* state, int stream, struct filterOutput* out)
+{
+    struct filterStream* s = &state->streams[stream];
+    if(!s->lineLen && !s->lineDropped) return 0;
+
+    return lineEnd(state, s, out);
+}
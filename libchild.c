@@ -26,11 +26,15 @@
 
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <stdlib.h>
@@ -45,6 +49,9 @@ extern char **environ;
 
 static const char* envName = "GjAG2W5xzoCarobfGY2MmA";
 
+/* Number of Child handles allocated at once */
+#define CHILD_POOL_SLAB 64
+
 static char* findExecPath()
 {
 #ifdef __linux__
@@ -69,19 +76,138 @@ static char* findExecPath()
 #endif
 }
 
-static void setState(Child* child, enum childStates state)
+static void releaseHeldBlocks(LibChild* lib)
+{
+    for(size_t i=0; i<lib->heldCount; i++) {
+        rxBlockRelease(lib->heldBlocks[i]);
+    }
+    lib->heldCount = 0;
+}
+
+static void freeLib(LibChild* lib)
+{
+    for(size_t i=lib->eventHead; i<lib->eventCount; i++) {
+        rxBlockRelease(lib->events[i].block);
+    }
+    free(lib->events);
+    releaseHeldBlocks(lib);
+    free(lib->heldBlocks);
+
+    close(lib->sockets[0]);
+    poolDestroy(&lib->childPool);
+    rxFree(&lib->rx);
+    rxBlockRelease(lib->arena);
+    free(lib->tx);
+    libChildDropFds(lib);
+    traceResize(&lib->trace, 0);
+    free(lib);
+}
+
+/* Events of CHILD_DATA_EVENTS mode are kept in order, the handle is passed out with each of them */
+static int queueEvent(LibChild* lib, struct libChildEvent* event, struct rxBlock* block)
+{
+    if(lib->eventCount == lib->eventSize) {
+        if(lib->eventHead) {
+            /* Reuse the space of the events that were handed out already */
+            memmove(lib->events, lib->events + lib->eventHead,
+                    (lib->eventCount - lib->eventHead) * sizeof(struct queuedEvent));
+            lib->eventCount -= lib->eventHead;
+            lib->eventHead = 0;
+        } else {
+            size_t newSize = lib->eventSize ? lib->eventSize * 2 : 64;
+            struct queuedEvent* newEvents = (struct queuedEvent*)realloc(lib->events, newSize * sizeof(struct queuedEvent));
+            if(!newEvents) return -1;
+
+            lib->events = newEvents;
+            lib->eventSize = newSize;
+        }
+    }
+
+    struct queuedEvent* queued = &lib->events[lib->eventCount++];
+    queued->event = *event;
+    queued->event.timestamp = lib->frameTime;
+    queued->block = block;
+    if(block) {
+        block->refs++;
+    }
+
+    return 0;
+}
+
+/* The handle goes away, so do the events for it that nobody has seen yet */
+static void dropEvents(LibChild* lib, Child* child)
+{
+    size_t out = lib->eventHead;
+    for(size_t i=lib->eventHead; i<lib->eventCount; i++) {
+        if(lib->events[i].event.child == child) {
+            rxBlockRelease(lib->events[i].block);
+        } else {
+            lib->events[out++] = lib->events[i];
+        }
+    }
+    lib->eventCount = out;
+}
+
+static void freeChild(Child* child)
+{
+    LibChild* lib = child->lib;
+    dropEvents(lib, child);
+    free(child->stageStatus);
+    poolFree(&lib->childPool, child);
+
+    /* The worker is gone and this was the last handle keeping it around */
+    if(lib->terminated && !lib->childPool.stats.inUse) {
+        freeLib(lib);
+    }
+}
+
+static void recordLatency(struct libChildHistogram* histogram, uint64_t now, uint64_t timestamp)
+{
+    histogramRecord(histogram, (now > timestamp) ? now - timestamp : 0);
+}
+
+/* Right before a callback, events only count once libChildPollEvents hands them out */
+static void recordDelivery(LibChild* lib)
+{
+    if(lib->frameTime) {
+        recordLatency(&lib->stats.eventToDelivered, libChildNow(), lib->frameTime);
+    }
+}
+
+static int setState(Child* child, enum childStates state)
 {
     child->state = state;
 
     if(child->unusedHandle || child->lib->unusedHandle) {
         if(child->state == CHILD_TERMINATED) {
-            free(child);
+            freeChild(child);
+        }
+    } else if(child->lib->dataMode == CHILD_DATA_EVENTS) {
+        /* The caller has the handle from the exec call already */
+        if(state != CHILD_STARTING) {
+            struct libChildEvent event;
+            memset(&event, 0, sizeof(event));
+            event.type = LIBCHILD_EVENT_STATE;
+            event.child = child;
+            event.param = child->param;
+            event.state = state;
+            return queueEvent(child->lib, &event, NULL);
         }
     } else {
         if(child->stateChange) {
+            recordDelivery(child->lib);
             child->stateChange(child, child->param, state);
         }
     }
+
+    return 0;
+}
+
+/* Output is captured for children with a childData callback, or for all of them in event mode */
+static int wantsData(LibChild* lib, Child* child)
+{
+    if(child->unusedHandle || lib->unusedHandle) return 0;
+    return child->childData || lib->dataMode == CHILD_DATA_EVENTS;
 }
 
 LibChild* libChildInPlace(void(*signalReceived)(siginfo_t signal, void* param), void* param){
@@ -89,6 +215,8 @@ LibChild* libChildInPlace(void(*signalReceived)(siginfo_t signal, void* param),
 
     if(lib) {
         memset(lib, 0, sizeof(*lib));
+        poolInit(&lib->childPool, sizeof(Child), CHILD_POOL_SLAB);
+        lib->traceDumpFd = -1;
         int retVal = socketpair(AF_UNIX, SOCK_STREAM, 0, lib->sockets);
 
         if(retVal < 0) {
@@ -113,6 +241,8 @@ LibChild* libChildInPlace(void(*signalReceived)(siginfo_t signal, void* param),
             libChildSlaveProcess(lib->sockets[1]);
             _exit(EXIT_FAILURE);
         }
+        /* The worker is the process we forked from */
+        lib->workerPid = getppid();
         close(lib->sockets[1]);
     }
 
@@ -123,12 +253,17 @@ fail:
     return NULL;
 }
 
-LibChild* libChildCreateWorker(char* slaveName, char* userName, void(*signalReceived)(siginfo_t signal, void* param), void* param)
+/* Starts the worker from slavePath, the command socket is passed as its argument. Without a
+ * path we execute ourselves again and libChildMain finds the socket in the environment. */
+static LibChild* startWorker(char* slavePath, char* slaveName, char* userName,
+                             void(*signalReceived)(siginfo_t signal, void* param), void* param)
 {
     LibChild* lib = (LibChild*)malloc(sizeof(LibChild));
 
     if(lib) {
         memset(lib, 0, sizeof(*lib));
+        poolInit(&lib->childPool, sizeof(Child), CHILD_POOL_SLAB);
+        lib->traceDumpFd = -1;
         int retVal = socketpair(AF_UNIX, SOCK_STREAM, 0, lib->sockets);
 
         if(retVal < 0) {
@@ -149,11 +284,16 @@ LibChild* libChildCreateWorker(char* slaveName, char* userName, void(*signalRece
             close(lib->sockets[0]);
 
             char socketId[32];
-            snprintf(socketId, sizeof(socketId), "%s=%u", envName, lib->sockets[1]);
-
-            char* execPath = findExecPath();
-            if(!execPath) {
-                _exit (EXIT_FAILURE);
+            char* execPath;
+            if(slavePath) {
+                snprintf(socketId, sizeof(socketId), "%u", lib->sockets[1]);
+                execPath = slavePath;
+            } else {
+                snprintf(socketId, sizeof(socketId), "%s=%u", envName, lib->sockets[1]);
+                execPath = findExecPath();
+                if(!execPath) {
+                    _exit (EXIT_FAILURE);
+                }
             }
 
             if(userName) {
@@ -163,6 +303,12 @@ LibChild* libChildCreateWorker(char* slaveName, char* userName, void(*signalRece
                 }
             }
 
+            if(slavePath) {
+                char *argv[] = { slaveName, socketId, NULL };
+                execve(execPath, argv, environ);
+                _exit (EXIT_FAILURE);
+            }
+
             char *argv[] = { slaveName, NULL };
 
             unsigned int i;
@@ -182,6 +328,7 @@ LibChild* libChildCreateWorker(char* slaveName, char* userName, void(*signalRece
             goto fail;
         }
 
+        lib->workerPid = lib->intermediatePid;
         close(lib->sockets[1]);
     }
 
@@ -192,57 +339,300 @@ fail:
     return NULL;
 }
 
+LibChild* libChildCreateWorker(char* slaveName, char* userName, void(*signalReceived)(siginfo_t signal, void* param), void* param)
+{
+    return startWorker(NULL, slaveName, userName, signalReceived, param);
+}
+
+/* Same, but runs the standalone libchild-slave binary instead of this program */
+LibChild* libChildCreateWorkerExec(char* slavePath, char* userName, void(*signalReceived)(siginfo_t signal, void* param), void* param)
+{
+    /* Fail here rather than with a worker that dies right away */
+    if(access(slavePath, X_OK)) {
+        return NULL;
+    }
+
+    return startWorker(slavePath, "libchild-slave", userName, signalReceived, param);
+}
+
 void libChildTerminateWorker(LibChild* lib)
 {
     lib->unusedHandle = 1;
 
     struct slaveCommand cmd;
     cmd.command = SLAVE_COMMAND_QUIT;
-    libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd));
+    if(!libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) {
+        libChildFlush(lib);
+    }
 
     /* Read all remaining messages */
     while(!libChildPoll(lib)) {}
 
-    free(lib);
+    /* Handles that are still held by the user keep the pool alive */
+    lib->terminated = 1;
+    if(!lib->childPool.stats.inUse) {
+        freeLib(lib);
+    }
+}
+
+static void sendKill(Child* child, int signalId)
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_KILL;
+    cmd.paramChildProcess = child->slaveId;
+    cmd.paramInteger = signalId;
+    if(!libChildWriteFull(child->lib, child->lib->sockets[0], (char*)&cmd, sizeof(cmd))) {
+        libChildFlush(child->lib);
+    }
 }
 
 void libChildKill(Child* child, int signalId)
 {
     if(child->slaveId) {
-        struct slaveCommand cmd;
-        cmd.command = SLAVE_COMMAND_KILL;
-        cmd.paramChildProcess = child->slaveId;
-        cmd.paramInteger = signalId;
-        libChildWriteFull(child->lib, child->lib->sockets[0], (char*)&cmd, sizeof(cmd));
+        sendKill(child, signalId);
+    } else if(child->state == CHILD_STARTING) {
+        /* Sent once the worker knows the child */
+        child->pendingKill = signalId;
+        child->hasPendingKill = 1;
     }
 
     libChildPoll(child->lib);
 }
 
+static void sendTerminate(Child* child, struct slaveTerminate* terminate)
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_TERMINATE;
+    cmd.paramChildProcess = child->slaveId;
+
+    size_t txMark = child->lib->txEnd;
+    if(libChildWriteFull(child->lib, child->lib->sockets[0], (char*)&cmd, sizeof(cmd)) ||
+       libChildWriteVariable(child->lib, child->lib->sockets[0], terminate, sizeof(*terminate))) {
+        child->lib->txEnd = txMark;
+    } else {
+        libChildFlush(child->lib);
+    }
+}
+
+void libChildTerminate(Child* child, int signalId, unsigned int graceMs, int finalSignal)
+{
+    struct slaveTerminate terminate;
+    terminate.signal = signalId;
+    terminate.graceMs = graceMs;
+    terminate.finalSignal = finalSignal;
+
+    if(child->slaveId) {
+        sendTerminate(child, &terminate);
+    } else if(child->state == CHILD_STARTING) {
+        /* The worker does not know about it yet, send it when it does */
+        child->pendingTerminate = terminate;
+        child->hasPendingTerminate = 1;
+    }
+
+    libChildPoll(child->lib);
+}
+
+/* What was asked for before the worker knew the child, in the order terminate then kill */
+static void sendPending(Child* child)
+{
+    if(child->hasPendingTerminate) {
+        child->hasPendingTerminate = 0;
+        sendTerminate(child, &child->pendingTerminate);
+    }
+    if(child->hasPendingKill) {
+        child->hasPendingKill = 0;
+        sendKill(child, child->pendingKill);
+    }
+}
+
+/* Terminates a set of children, or all of them when children is NULL, with one message.
+ * They are signalled together and share the same escalation deadline. */
+int libChildTerminateMany(LibChild* lib, Child** children, size_t count,
+                          int signalId, unsigned int graceMs, int finalSignal)
+{
+    struct slaveTerminate terminate;
+    terminate.signal = signalId;
+    terminate.graceMs = graceMs;
+    terminate.finalSignal = finalSignal;
+
+    void** slaveIds = NULL;
+    size_t slaveCount = 0;
+
+    if(children) {
+        slaveIds = (void**)malloc(sizeof(void*) * (count ? count : 1));
+        if(!slaveIds) {
+            return -1;
+        }
+
+        for(size_t i=0; i<count; i++) {
+            Child* child = children[i];
+            if(child->slaveId) {
+                slaveIds[slaveCount++] = child->slaveId;
+            } else if(child->state == CHILD_STARTING) {
+                child->pendingTerminate = terminate;
+                child->hasPendingTerminate = 1;
+            }
+        }
+    }
+
+    int retVal = 0;
+    if(!children || slaveCount) {
+        struct slaveCommand cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.command = SLAVE_COMMAND_TERMINATE_MANY;
+        cmd.paramInteger = children ? 0 : SLAVE_TERMINATE_ALL;
+
+        size_t txMark = lib->txEnd;
+        if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd)) ||
+           libChildWriteVariable(lib, lib->sockets[0], &terminate, sizeof(terminate)) ||
+           libChildWriteVariable(lib, lib->sockets[0], slaveIds, slaveCount * sizeof(void*))) {
+            lib->txEnd = txMark;
+            retVal = -1;
+        } else {
+            libChildFlush(lib);
+        }
+    }
+
+    /* With children NULL this also covers execs the worker has not reported yet,
+     * they are handled before this command */
+    free(slaveIds);
+
+    libChildPoll(lib);
+    return retVal;
+}
+
+void libChildExecOptionsInit(struct childExecOptions* options)
+{
+    memset(options, 0, sizeof(*options));
+    options->killSignal = SIGTERM;
+    options->killGraceMs = 5000;
+    options->finalSignal = SIGKILL;
+    options->stdinFd = -1;
+    options->stdoutFd = -1;
+    options->stderrFd = -1;
+    options->outputFilter = NULL;
+}
+
 Child* libChildExec(LibChild* lib, char* program, char* username, char** argv, char** env,
                     void(*stateChange)(Child* child, void* param, enum childStates state),
                     void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
                     void* param)
 {
-    Child* child = (Child*)malloc(sizeof(Child));
-    if(!child) goto fail;
+    return libChildExecWithOptions(lib, program, username, argv, env, NULL, stateChange, childData, param);
+}
 
-    memset(child, 0, sizeof(Child));
+static void toWireOptions(const struct childExecOptions* options, struct slaveExecOptions* wireOptions)
+{
+    struct childExecOptions defaultOptions;
+    if(!options) {
+        libChildExecOptionsInit(&defaultOptions);
+        options = &defaultOptions;
+    }
 
-    struct slaveCommand cmd;
-    if(childData) {
-        cmd.command = SLAVE_COMMAND_EXEC_PIPE;
-    } else {
-        cmd.command = SLAVE_COMMAND_EXEC;
+    memset(wireOptions, 0, sizeof(*wireOptions));
+    wireOptions->stdioFds = (options->stdinFd >= 0 ? 1 : 0) |
+                            (options->stdoutFd >= 0 ? 2 : 0) |
+                            (options->stderrFd >= 0 ? 4 : 0);
+    wireOptions->filter = (options->outputFilter != NULL);
+    wireOptions->flags = options->flags;
+    wireOptions->deadlineMs = options->deadlineMs;
+    wireOptions->killSignal = options->killSignal;
+    wireOptions->killGraceMs = options->killGraceMs;
+    wireOptions->finalSignal = options->finalSignal;
+    wireOptions->tailBytes = options->tailBytes;
+    wireOptions->priority = options->priority;
+    wireOptions->tag = options->tag;
+    wireOptions->outputWeight = options->outputWeight;
+}
+
+/* Queues the stdio redirections announced in wireOptions->stdioFds */
+static int queueStdio(LibChild* lib, const struct childExecOptions* options)
+{
+    if(!options) return 0;
+
+    int stdio[3] = {options->stdinFd, options->stdoutFd, options->stderrFd};
+    int fds[3];
+    unsigned int count = 0;
+
+    for(unsigned int i=0; i<3; i++) {
+        if(stdio[i] >= 0) {
+            fds[count++] = stdio[i];
+        }
     }
 
-    cmd.masterEcho = child;
+    if(!count) return 0;
+    return libChildQueueFds(lib, fds, count);
+}
+
+/* Queues the output filter announced in wireOptions->filter */
+static int queueFilter(LibChild* lib, const struct childExecOptions* options)
+{
+    if(!options || !options->outputFilter) return 0;
+    const struct childOutputFilter* filter = options->outputFilter;
+
+    /* The worker builds a table with a state per pattern byte */
+    size_t total = 0;
+    for(char** it = filter->patterns; it && *it; it++) {
+        total += strlen(*it);
+    }
+    if(total >= FILTER_MAX_STATES) return -1;
+
+    struct slaveFilter wireFilter;
+    memset(&wireFilter, 0, sizeof(wireFilter));
+    wireFilter.sampleEvery = filter->sampleEvery;
+    wireFilter.byteCap = filter->byteCap;
+
+    if(libChildWriteVariable(lib, lib->sockets[0], &wireFilter, sizeof(wireFilter))) return -1;
+    return libChildWritePack(lib, lib->sockets[0], filter->patterns);
+}
+
+static Child* newChild(LibChild* lib,
+                       void(*stateChange)(Child* child, void* param, enum childStates state),
+                       void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                       void* param)
+{
+    Child* child = (Child*)poolAlloc(&lib->childPool);
+    if(!child) return NULL;
+
+    memset(child, 0, sizeof(Child));
 
     child->param = param;
     child->slaveId = NULL;
     child->stateChange = stateChange;
     child->childData = childData;
     child->lib = lib;
+    child->submitted = libChildNow();
+    TRACE(&lib->trace, exec_submit, LIBCHILD_TRACE_EXEC_SUBMIT, 0, (uintptr_t)child);
+
+    return child;
+}
+
+Child* libChildExecWithOptions(LibChild* lib, char* program, char* username, char** argv, char** env,
+                               const struct childExecOptions* options,
+                               void(*stateChange)(Child* child, void* param, enum childStates state),
+                               void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                               void* param)
+{
+    struct slaveExecOptions wireOptions;
+    toWireOptions(options, &wireOptions);
+    if(wireOptions.tailBytes > TAIL_MAX_BYTES) return NULL;
+
+    /* Drop a partially queued message if we cannot queue all of it */
+    size_t txMark = lib->txEnd;
+
+    Child* child = newChild(lib, stateChange, childData, param);
+    if(!child) goto fail;
+
+    struct slaveCommand cmd;
+    if(childData || lib->dataMode == CHILD_DATA_EVENTS) {
+        cmd.command = SLAVE_COMMAND_EXEC_PIPE;
+    } else {
+        cmd.command = SLAVE_COMMAND_EXEC;
+    }
+
+    cmd.masterEcho = child;
 
     if(!username) {
         username = "";
@@ -253,6 +643,11 @@ Child* libChildExec(LibChild* lib, char* program, char* username, char** argv, c
     if(libChildWriteVariable(lib, lib->sockets[0], username, strlen(username))) goto fail;
     if(libChildWritePack(lib, lib->sockets[0], argv)) goto fail;
     if(libChildWritePack(lib, lib->sockets[0], env)) goto fail;
+    if(libChildWriteVariable(lib, lib->sockets[0], &wireOptions, sizeof(wireOptions))) goto fail;
+    if(queueStdio(lib, options)) goto fail;
+    if(queueFilter(lib, options)) goto fail;
+    /* A failed flush also drops the frame, it names a handle that is freed below */
+    if(libChildFlush(lib)) goto fail;
 
     setState(child, CHILD_STARTING);
     
@@ -260,10 +655,101 @@ Child* libChildExec(LibChild* lib, char* program, char* username, char** argv, c
     return child;
 
 fail:
-    if(child) free(child);
+    libChildTxRollback(lib, txMark);
+    if(child) poolFree(&lib->childPool, child);
     return NULL;
 }
 
+/* Runs stages[0] | stages[1] | ... in the worker, the stages are connected by pipes directly.
+ * childData gets the output of the last stage and stderr of all of them. The pipeline leads
+ * its own process group, so signals and deadlines apply to every stage. */
+Child* libChildExecPipeline(LibChild* lib, char* username, char** env,
+                            const struct childPipelineStage* stages, unsigned int count,
+                            const struct childExecOptions* options,
+                            void(*stateChange)(Child* child, void* param, enum childStates state),
+                            void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                            void* param)
+{
+    if(!count || count > PIPELINE_MAX_STAGES) return NULL;
+
+    struct slaveExecOptions wireOptions;
+    toWireOptions(options, &wireOptions);
+    wireOptions.flags |= CHILD_EXEC_PROCESS_GROUP;
+    if(wireOptions.tailBytes > TAIL_MAX_BYTES) return NULL;
+
+    size_t txMark = lib->txEnd;
+
+    Child* child = newChild(lib, stateChange, childData, param);
+    if(!child) goto fail;
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_EXEC_PIPELINE;
+    cmd.masterEcho = child;
+    /* Output goes to /dev/null unless someone wants it */
+    cmd.paramInteger = (count << 1) | ((childData || lib->dataMode == CHILD_DATA_EVENTS) ? 1 : 0);
+
+    if(!username) {
+        username = "";
+    }
+
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) goto fail;
+    if(libChildWriteVariable(lib, lib->sockets[0], username, strlen(username))) goto fail;
+    if(libChildWritePack(lib, lib->sockets[0], env)) goto fail;
+    if(libChildWriteVariable(lib, lib->sockets[0], &wireOptions, sizeof(wireOptions))) goto fail;
+    if(queueStdio(lib, options)) goto fail;
+    if(queueFilter(lib, options)) goto fail;
+    for(unsigned int i=0; i<count; i++) {
+        if(libChildWriteVariable(lib, lib->sockets[0], stages[i].program, strlen(stages[i].program))) goto fail;
+        if(libChildWritePack(lib, lib->sockets[0], stages[i].argv)) goto fail;
+    }
+    /* A failed flush also drops the frame, it names a handle that is freed below */
+    if(libChildFlush(lib)) goto fail;
+
+    setState(child, CHILD_STARTING);
+
+    libChildPoll(lib);
+    return child;
+
+fail:
+    libChildTxRollback(lib, txMark);
+    if(child) poolFree(&lib->childPool, child);
+    return NULL;
+}
+
+/* Counters of the output filter, only once the child has terminated */
+int libChildFilterStats(Child* child, struct childFilterStats* stats)
+{
+    if(!child->hasFilterStats) return -1;
+
+    *stats = child->filterStats;
+    return 0;
+}
+
+/* Asks the worker for the tail of a child started with tailBytes, it arrives through childData.
+ * Fails if the worker does not know the child (yet). */
+int libChildFetchTail(Child* child)
+{
+    if(!child->slaveId) return -1;
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_FETCH_TAIL;
+    cmd.paramChildProcess = child->slaveId;
+    if(libChildWriteFull(child->lib, child->lib->sockets[0], (char*)&cmd, sizeof(cmd))) return -1;
+    if(libChildFlush(child->lib)) return -1;
+
+    libChildPoll(child->lib);
+    return 0;
+}
+
+/* Exit status of one stage of a terminated pipeline, -1 if it is not known */
+int libChildPipelineStatus(Child* child, unsigned int stage)
+{
+    if(stage >= child->stageCount) return -1;
+    return child->stageStatus[stage];
+}
+
 int libChildExitStatus(Child* child)
 {
     return child->exitStatus;
@@ -271,81 +757,745 @@ int libChildExitStatus(Child* child)
 
 void libChildFreeHandle(Child* child)
 {
-    if(child->state == CHILD_TERMINATED) {
-        free(child);
+    if(child->state == CHILD_TERMINATED || child->lib->terminated) {
+        freeChild(child);
     } else {
         child->unusedHandle = 1;
     }
 }
 
+/* Returns the length of the frame at the head of the receive buffer, or 0 if it is not complete yet.
+ * In that case wanted is set to the amount of data needed to make progress. */
+static size_t frameLength(LibChild* lib, size_t* wanted)
+{
+    struct slaveResponse resp;
+    size_t len = sizeof(resp);
+
+    char* head = rxPeek(&lib->rx, len);
+    if(!head) {
+        *wanted = len;
+        return 0;
+    }
+    memcpy(&resp, head, sizeof(resp));
+
+    if(resp.result == SLAVE_RESULT_CHILD_STDOUT_DATA ||
+       resp.result == SLAVE_RESULT_CHILD_STDERR_DATA ||
+       resp.result == SLAVE_RESULT_STATS ||
+       resp.result == SLAVE_RESULT_TRACE ||
+       resp.result == SLAVE_RESULT_PIPELINE_STATUS ||
+       resp.result == SLAVE_RESULT_FILTER_STATS ||
+       resp.result == SLAVE_RESULT_TAIL ||
+       resp.result == SLAVE_RESULT_SNAPSHOT ||
+       resp.result == SLAVE_RESULT_USAGE) {
+        unsigned int payloadLen;
+        head = rxPeek(&lib->rx, len + sizeof(payloadLen));
+        if(!head) {
+            *wanted = len + sizeof(payloadLen);
+            return 0;
+        }
+        memcpy(&payloadLen, head + len, sizeof(payloadLen));
+        len += sizeof(payloadLen) + payloadLen;
+
+    } else if(resp.result == SLAVE_RESULT_GOT_SIGNAL) {
+        len += sizeof(siginfo_t);
+    }
+
+    if(!rxPeek(&lib->rx, len)) {
+        *wanted = len;
+        return 0;
+    }
+
+    return len;
+}
+
+static int deliverData(LibChild* lib, Child* child, struct rxBlock* block, char* buffer, unsigned int len, int isErr)
+{
+    if(lib->dataMode == CHILD_DATA_EVENTS) {
+        struct libChildEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = LIBCHILD_EVENT_DATA;
+        event.child = child;
+        event.param = child->param;
+        event.data = buffer;
+        event.len = len;
+        event.isErr = isErr;
+        return queueEvent(lib, &event, block);
+    }
+
+    if(lib->dataMode != CHILD_DATA_ZEROCOPY) {
+        /* Copy the payload so the callback gets a terminated string */
+        if(rxBlockReserve(&lib->arena, len + 1)) return -1;
+        block = lib->arena;
+        memcpy(block->data, buffer, len);
+        block->data[len] = 0;
+        buffer = block->data;
+    }
+
+    /* Hold a reference, a nested poll will then move on to a new block instead of reusing this one */
+    block->refs++;
+    struct rxBlock* outerBlock = lib->deliverBlock;
+    lib->deliverBlock = block;
+
+    recordDelivery(lib);
+    child->childData(child, child->param, buffer, len, isErr);
+
+    lib->deliverBlock = outerBlock;
+    rxBlockRelease(block);
+
+    return 0;
+}
+
+/* Adds the records of a sample to the totals of the children and reports them */
+static int deliverUsage(LibChild* lib, struct rxBlock* block, char* payload, uint64_t sampled)
+{
+    unsigned int len;
+    memcpy(&len, payload, sizeof(len));
+    payload += sizeof(len);
+
+    /* Callbacks may poll again, the records have to stay where they are */
+    block->refs++;
+
+    int retVal = 0;
+    unsigned int count = len / sizeof(struct slaveUsageRecord);
+    for(unsigned int i=0; i<count; i++) {
+        struct slaveUsageRecord record;
+        memcpy(&record, payload + i * sizeof(record), sizeof(record));
+
+        Child* child = (Child*)record.masterEcho;
+        child->usage.cpuNs += record.usage.cpuNs;
+        child->usage.readBytes += record.usage.readBytes;
+        child->usage.writeBytes += record.usage.writeBytes;
+        child->usage.majorFaults += record.usage.majorFaults;
+        child->usage.rssBytes = record.usage.rssBytes;
+        child->usage.threads = record.usage.threads;
+        child->usage.sampled = sampled;
+        child->hasUsage = 1;
+
+        if(child->unusedHandle) continue;
+
+        if(lib->dataMode == CHILD_DATA_EVENTS) {
+            struct libChildEvent event;
+            memset(&event, 0, sizeof(event));
+            event.type = LIBCHILD_EVENT_USAGE;
+            event.child = child;
+            event.param = child->param;
+            event.usage = child->usage;
+            if(queueEvent(lib, &event, NULL)) {
+                retVal = -1;
+                break;
+            }
+        } else if(lib->usageSampled) {
+            recordDelivery(lib);
+            lib->usageSampled(child, child->param, &child->usage);
+        }
+    }
+
+    rxBlockRelease(block);
+    return retVal;
+}
+
+/* Creates handles for the children listed in a snapshot and tells the worker about them */
+static int adoptChildren(LibChild* lib, char* payload)
+{
+    unsigned int len;
+    memcpy(&len, payload, sizeof(len));
+    payload += sizeof(len);
+
+    unsigned int count = len / sizeof(struct slaveSnapshotEntry);
+    struct slaveAdoptEntry* adopted = (struct slaveAdoptEntry*)malloc((count ? count : 1) * sizeof(struct slaveAdoptEntry));
+    if(!adopted) return -1;
+
+    for(unsigned int i=0; i<count; i++) {
+        struct slaveSnapshotEntry entry;
+        memcpy(&entry, payload + i * sizeof(entry), sizeof(entry));
+
+        Child* child = newChild(lib, NULL, NULL, lib->param);
+        if(!child) {
+            free(adopted);
+            return -1;
+        }
+        child->slaveId = entry.slaveId;
+        child->pid = entry.pid;
+        child->state = CHILD_STARTED;
+
+        adopted[i].slaveId = entry.slaveId;
+        adopted[i].masterEcho = child;
+
+        if(lib->adopt) {
+            lib->adopt(child, lib->param);
+        }
+    }
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_ADOPT;
+
+    int retVal = -1;
+    if(!libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd)) &&
+       !libChildWriteVariable(lib, lib->sockets[0], adopted, count * sizeof(struct slaveAdoptEntry))) {
+        retVal = libChildFlush(lib);
+    }
+
+    free(adopted);
+    lib->snapshotReceived = 1;
+    return retVal;
+}
+
 int libChildPoll(LibChild* lib)
 {
+    lib->stats.pollCalls++;
+
     while(1){
+        size_t wanted;
+        size_t frameLen = frameLength(lib, &wanted);
+        if(!frameLen) {
+            int retVal = rxFill(&lib->rx, lib->sockets[0], wanted);
+            if(retVal == 1){
+                break;
+            }else if(retVal < 0){
+                goto fail;
+            }
+            continue;
+        }
+
+        /* Consume the frame before calling back, callbacks may poll again */
+        struct rxBlock* block = lib->rx.block;
+        char* frame = rxPeek(&lib->rx, frameLen);
+        rxConsume(&lib->rx, frameLen);
+
         struct slaveResponse resp;
-        memset(&resp, 0, sizeof(resp));
+        memcpy(&resp, frame, sizeof(resp));
+        char* payload = frame + sizeof(resp);
 
-        int retVal = libChildReadFull(lib->sockets[0], (char*)&resp, sizeof(resp), 1);
-        if(retVal == 1){
-            break;
-        }else if(retVal < 0){
-            goto fail;
-        }
+        lib->stats.framesReceived++;
+        recordLatency(&lib->stats.eventToReceived, libChildNow(), resp.timestamp);
+
+        /* Callbacks may poll again, the outer frame is still being delivered afterwards */
+        uint64_t outerTime = lib->frameTime;
+        lib->frameTime = resp.timestamp;
 
         Child* child = (Child*)resp.masterEcho;
         if(resp.result == SLAVE_RESULT_CHILD_CREATED) {
+            histogramRecord(&lib->stats.spawnToStarted, libChildNow() - child->submitted);
+            TRACE(&lib->trace, child_created, LIBCHILD_TRACE_CHILD_CREATED, resp.paramInteger, (uintptr_t)child);
             child->pid = resp.paramInteger;
             child->slaveId = resp.paramChildProcess;
-            setState(child, CHILD_STARTED);
+            if(child->slaveId) {
+                sendPending(child);
+            }
+            if(!child->slaveId) {
+                /* It could not be started, or a server refused it: no exit will follow */
+                child->exitStatus = EXIT_FAILURE << 8;
+                if(setState(child, CHILD_TERMINATED)) goto fail;
+            } else if(setState(child, CHILD_STARTED)) goto fail;
     
+        } else if(resp.result == SLAVE_RESULT_CHILD_QUEUED) {
+            child->slaveId = resp.paramChildProcess;
+            sendPending(child);
+            if(setState(child, CHILD_QUEUED)) goto fail;
+
         } else if(resp.result == SLAVE_RESULT_CHILD_DIED) {
             void* slaveId = child->slaveId;
             child->slaveId = NULL;
+            TRACE(&lib->trace, close_handle, LIBCHILD_TRACE_CLOSE_HANDLE, child->pid, (uintptr_t)child);
             child->exitStatus = resp.paramInteger;
     
-            setState(child, CHILD_TERMINATED);
+            if(setState(child, CHILD_TERMINATED)) goto fail;
 
             struct slaveCommand cmd;
             cmd.command = SLAVE_COMMAND_CLOSE_HANDLE;
             cmd.paramChildProcess = slaveId;
             if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) goto fail;
+            if(libChildFlush(lib)) goto fail;
 
         } else if(resp.result == SLAVE_RESULT_CHILD_STDOUT_DATA ||
                   resp.result == SLAVE_RESULT_CHILD_STDERR_DATA) {
 
             unsigned int len;
-            char* buffer = libChildReadVariable(lib->sockets[0], &len);
-            if(!buffer) goto fail;
-            if(!child->unusedHandle && !lib->unusedHandle && child->childData) {
-                child->childData(child, child->param, buffer, len, resp.result == SLAVE_RESULT_CHILD_STDERR_DATA);
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            if(wantsData(lib, child)) {
+                if(deliverData(lib, child, block, payload, len, resp.result == SLAVE_RESULT_CHILD_STDERR_DATA)) goto fail;
+            }
+        } else if(resp.result == SLAVE_RESULT_TAIL) {
+            unsigned int len;
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            unsigned int outLen = resp.paramInteger;
+            if(outLen > len) goto fail;
+
+            if(wantsData(lib, child)) {
+                if(outLen && deliverData(lib, child, block, payload, outLen, 0)) goto fail;
+                if(len > outLen && deliverData(lib, child, block, payload + outLen, len - outLen, 1)) goto fail;
             }
-            free(buffer);
         } else if(resp.result == SLAVE_RESULT_GOT_SIGNAL) {
             siginfo_t sigInfo;
-            if(libChildReadFull(lib->sockets[0], (char*)&sigInfo, sizeof(sigInfo), 0)) goto fail;
+            memcpy(&sigInfo, payload, sizeof(sigInfo));
 
-            if(lib->signalReceived){
+            if(lib->dataMode == CHILD_DATA_EVENTS) {
+                struct libChildEvent event;
+                memset(&event, 0, sizeof(event));
+                event.type = LIBCHILD_EVENT_SIGNAL;
+                event.signal = sigInfo;
+                if(queueEvent(lib, &event, NULL)) goto fail;
+            } else if(lib->signalReceived){
+                recordDelivery(lib);
                 lib->signalReceived(sigInfo, lib->param);
             }
+        } else if(resp.result == SLAVE_RESULT_STATS) {
+            unsigned int len;
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            /* A server refuses with an empty answer */
+            if(len != sizeof(struct libChildStats)) {
+                lib->statsReceived = -1;
+            } else {
+                if(lib->statsRequest) {
+                    memcpy(lib->statsRequest, payload, len);
+                }
+                lib->statsReceived = 1;
+            }
+
+        } else if(resp.result == SLAVE_RESULT_PIPELINE_STATUS) {
+            unsigned int len;
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            /* Not fatal, the status of the last stage is still reported */
+            free(child->stageStatus);
+            child->stageStatus = (int*)malloc(len ? len : 1);
+            if(child->stageStatus) {
+                memcpy(child->stageStatus, payload, len);
+                child->stageCount = len / sizeof(int);
+            } else {
+                child->stageCount = 0;
+            }
+
+        } else if(resp.result == SLAVE_RESULT_FILTER_STATS) {
+            unsigned int len;
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            if(len == sizeof(struct childFilterStats)) {
+                memcpy(&child->filterStats, payload, len);
+                child->hasFilterStats = 1;
+            }
+
+        } else if(resp.result == SLAVE_RESULT_LISTENING) {
+            lib->listenResult = resp.paramInteger;
+            lib->listenReceived = 1;
+
+        } else if(resp.result == SLAVE_RESULT_SNAPSHOT) {
+            if(adoptChildren(lib, payload)) goto fail;
+
+        } else if(resp.result == SLAVE_RESULT_USAGE) {
+            if(deliverUsage(lib, block, payload, resp.timestamp)) goto fail;
+
+        } else if(resp.result == SLAVE_RESULT_TRACE) {
+            unsigned int len;
+            memcpy(&len, payload, sizeof(len));
+            payload += sizeof(len);
+
+            while(len && lib->traceDumpFd >= 0) {
+                ssize_t bytesWritten = write(lib->traceDumpFd, payload, len);
+                if(bytesWritten < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                len -= bytesWritten;
+                payload += bytesWritten;
+            }
+            lib->traceReceived = 1;
         }
+
+        lib->frameTime = outerTime;
     }
 
     return 0;
 
 fail:
-    /* Could not read, so the worker process died */
+    /* Could not read, so the worker process died. An attached one is not ours to wait for. */
     if(!lib->workerDied) {
         int status;
-        waitpid(lib->intermediatePid, &status, 0);
+        if(lib->intermediatePid > 0) {
+            waitpid(lib->intermediatePid, &status, 0);
+        }
         lib->workerDied = 1;
     }
     return -1;
 }
 
+/* Event mode counterpart of libChildPoll: reads what is available and returns up to max events,
+ * -1 once the worker is gone and nothing is left. Data stays valid until the next call. More
+ * events may be queued when it returns max, without the descriptor becoming readable again. */
+int libChildPollEvents(LibChild* lib, struct libChildEvent* events, size_t max)
+{
+    releaseHeldBlocks(lib);
+
+    int retVal = 0;
+    if(lib->eventCount - lib->eventHead < max) {
+        retVal = libChildPoll(lib);
+    }
+
+    size_t count = lib->eventCount - lib->eventHead;
+    if(count > max) {
+        count = max;
+    }
+
+    if(count > lib->heldSize) {
+        struct rxBlock** newHeld = (struct rxBlock**)realloc(lib->heldBlocks, count * sizeof(struct rxBlock*));
+        if(!newHeld) return -1;
+
+        lib->heldBlocks = newHeld;
+        lib->heldSize = count;
+    }
+
+    uint64_t now = libChildNow();
+    for(size_t i=0; i<count; i++) {
+        struct queuedEvent* queued = &lib->events[lib->eventHead++];
+        events[i] = queued->event;
+        if(events[i].timestamp) {
+            recordLatency(&lib->stats.eventToDelivered, now, events[i].timestamp);
+        }
+        if(queued->block) {
+            lib->heldBlocks[lib->heldCount++] = queued->block;
+        }
+    }
+
+    if(lib->eventHead == lib->eventCount) {
+        lib->eventHead = 0;
+        lib->eventCount = 0;
+    }
+
+    if(!count && retVal) return -1;
+    return count;
+}
+
 int libChildGetFd(LibChild* lib)
 {
     return lib->sockets[0];
 }
 
+/* Pid of the worker, signals sent to it are forwarded to signalReceived. -1 for a worker
+ * we attached or connected to. */
+int libChildWorkerPid(LibChild* lib)
+{
+    return lib->workerPid;
+}
+
+void libChildGetPoolStats(LibChild* lib, struct libChildPoolStats* childPool, size_t* receiveArena)
+{
+    if(childPool) {
+        *childPool = lib->childPool.stats;
+    }
+    if(receiveArena) {
+        *receiveArena = 0;
+        if(lib->rx.block) {
+            *receiveArena += lib->rx.block->size;
+        }
+        if(lib->arena) {
+            *receiveArena += lib->arena->size;
+        }
+    }
+}
+
+/* Sends the queued request and keeps handling other messages until the answer arrives */
+static int waitForReply(LibChild* lib, int* received)
+{
+    if(libChildFlush(lib)) return -1;
+
+    while(!*received) {
+        struct pollfd fds[1];
+        fds[0].fd = lib->sockets[0];
+        fds[0].events = POLLIN;
+        if(poll(fds, 1, -1) < 0 && errno != EINTR) return -1;
+
+        if(libChildPoll(lib)) return -1;
+    }
+
+    return 0;
+}
+
+int libChildGetStats(LibChild* lib, struct libChildStats* stats)
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_GET_STATS;
+
+    memset(stats, 0, sizeof(*stats));
+    lib->statsRequest = stats;
+    lib->statsReceived = 0;
+
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) goto fail;
+    if(waitForReply(lib, &lib->statsReceived)) goto fail;
+    if(lib->statsReceived < 0) goto fail;
+    lib->statsRequest = NULL;
+
+    stats->framesReceived = lib->stats.framesReceived;
+    stats->pollCalls = lib->stats.pollCalls;
+    stats->writeStalls = lib->stats.writeStalls;
+    stats->spawnToStarted = lib->stats.spawnToStarted;
+    stats->eventToReceived = lib->stats.eventToReceived;
+    stats->eventToDelivered = lib->stats.eventToDelivered;
+
+    return 0;
+
+fail:
+    lib->statsRequest = NULL;
+    return -1;
+}
+
+/* Limits how many children run at once: in total, per user they run as and per tag. Requests
+ * over a limit wait in the worker in CHILD_QUEUED state. 0 is unlimited. A shared worker
+ * keeps the limits it was started with. */
+int libChildSetLimits(LibChild* lib, unsigned int maxRunning, unsigned int maxPerUser, unsigned int maxPerTag)
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_SET_LIMITS;
+
+    struct slaveLimits limits;
+    limits.maxRunning = maxRunning;
+    limits.maxPerUser = maxPerUser;
+    limits.maxPerTag = maxPerTag;
+
+    size_t txMark = lib->txEnd;
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd)) ||
+       libChildWriteVariable(lib, lib->sockets[0], &limits, sizeof(limits))) {
+        libChildTxRollback(lib, txMark);
+        return -1;
+    }
+    return libChildFlush(lib);
+}
+
+/* Has the worker sample the resource use of every running child each intervalMs, 0 stops it.
+ * usageSampled is called for the children whose use changed, in event mode LIBCHILD_EVENT_USAGE
+ * is returned instead. Only Linux workers sample. */
+int libChildSetSampling(LibChild* lib, unsigned int intervalMs,
+                        void(*usageSampled)(Child* child, void* param, const struct childUsage* usage))
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_SET_SAMPLING;
+    cmd.paramInteger = intervalMs;
+
+    lib->usageSampled = usageSampled;
+
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) return -1;
+    return libChildFlush(lib);
+}
+
+/* The totals of the last sample, fails if there was none yet */
+int libChildGetUsage(Child* child, struct childUsage* usage)
+{
+    if(!child->hasUsage) return -1;
+
+    *usage = child->usage;
+    return 0;
+}
+
+int libChildTraceEnable(LibChild* lib, unsigned int entries)
+{
+    if(traceResize(&lib->trace, entries)) return -1;
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_TRACE;
+    cmd.paramInteger = entries;
+
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) return -1;
+    return libChildFlush(lib);
+}
+
+int libChildTraceDump(LibChild* lib, int fd)
+{
+    if(traceWrite(&lib->trace, fd)) return -1;
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_TRACE_DUMP;
+
+    lib->traceDumpFd = fd;
+    lib->traceReceived = 0;
+
+    int retVal = -1;
+    if(!libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) {
+        retVal = waitForReply(lib, &lib->traceReceived);
+    }
+
+    lib->traceDumpFd = -1;
+    return retVal;
+}
+
+/* Lets the worker outlive us. It listens on path and keeps the children running when the
+ * connection is lost, until a new master takes over with libChildAttach. */
+int libChildSetDetachable(LibChild* lib, const char* path)
+{
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_LISTEN;
+
+    lib->listenReceived = 0;
+
+    size_t txMark = lib->txEnd;
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd)) ||
+       libChildWriteVariable(lib, lib->sockets[0], (void*)path, strlen(path))) {
+        libChildTxRollback(lib, txMark);
+        return -1;
+    }
+    if(waitForReply(lib, &lib->listenReceived)) return -1;
+
+    if(lib->listenResult) {
+        errno = lib->listenResult;
+        return -1;
+    }
+    return 0;
+}
+
+static LibChild* connectWorker(const char* path, void(*signalReceived)(siginfo_t signal, void* param), void* param)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return NULL;
+    strcpy(addr.sun_path, path);
+
+    LibChild* lib = (LibChild*)malloc(sizeof(LibChild));
+    if(!lib) return NULL;
+
+    memset(lib, 0, sizeof(*lib));
+    poolInit(&lib->childPool, sizeof(Child), CHILD_POOL_SLAB);
+    lib->traceDumpFd = -1;
+    lib->intermediatePid = -1;
+    lib->workerPid = -1;
+    lib->sockets[1] = -1;
+    lib->signalReceived = signalReceived;
+    lib->param = param;
+
+    lib->sockets[0] = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(lib->sockets[0] < 0) {
+        free(lib);
+        return NULL;
+    }
+
+#ifdef __APPLE__
+    {
+        int set = 1;
+        setsockopt(lib->sockets[0], SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set));
+    }
+#endif
+
+    if(connect(lib->sockets[0], (struct sockaddr*)&addr, sizeof(addr))) {
+        freeLib(lib);
+        return NULL;
+    }
+
+    return lib;
+}
+
+/* Takes over a detachable worker. adopt is called with a handle for every child it still has,
+ * in STARTED state, use libChildSetCallbacks there. Output produced while the worker had no
+ * master is delivered afterwards, as are exits. */
+LibChild* libChildAttach(const char* path, void(*signalReceived)(siginfo_t signal, void* param), void* param,
+                         void(*adopt)(Child* child, void* param))
+{
+    LibChild* lib = connectWorker(path, signalReceived, param);
+    if(!lib) return NULL;
+
+    struct slaveCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = SLAVE_COMMAND_ATTACH;
+
+    lib->adopt = adopt;
+    if(libChildWriteFull(lib, lib->sockets[0], (char*)&cmd, sizeof(cmd))) goto fail;
+    if(waitForReply(lib, &lib->snapshotReceived)) goto fail;
+    lib->adopt = NULL;
+
+    return lib;
+
+fail:
+    /* Handles adopted before a failure stay valid, they keep the rest alive */
+    lib->workerDied = 1;
+    lib->terminated = 1;
+    if(!lib->childPool.stats.inUse) {
+        freeLib(lib);
+    }
+    return NULL;
+}
+
+/* Connects to a shared worker started with libchild-slave --listen. Only children started over
+ * this connection are visible, they are killed when it is closed or libChildTerminateWorker is
+ * called. Starts the server refuses, because of a limit or a user that is not ours, end right
+ * away with EXIT_FAILURE. Worker statistics and tracing are only available to the user the
+ * server runs as and to root, libChildGetStats fails for others. */
+LibChild* libChildConnect(const char* path, void(*signalReceived)(siginfo_t signal, void* param), void* param)
+{
+    return connectWorker(path, signalReceived, param);
+}
+
+/* Drops the connection without stopping the worker, which keeps the children if it is detachable.
+ * Handles that are still held stay allocated until freed, but nothing happens to them anymore. */
+void libChildDetach(LibChild* lib)
+{
+    libChildFlush(lib);
+    shutdown(lib->sockets[0], SHUT_RDWR);
+
+    lib->workerDied = 1;
+    lib->terminated = 1;
+    if(!lib->childPool.stats.inUse) {
+        freeLib(lib);
+    }
+}
+
+void libChildSetCallbacks(Child* child,
+                          void(*stateChange)(Child* child, void* param, enum childStates state),
+                          void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                          void* param)
+{
+    child->stateChange = stateChange;
+    child->childData = childData;
+    child->param = param;
+}
+
+int libChildPid(Child* child)
+{
+    return child->pid;
+}
+
+/* CLOCK_MONOTONIC ns at which the worker saw the event a callback is running for: the read of
+ * the output, the fork, or the reap. 0 outside of callbacks. */
+unsigned long long libChildEventTime(Child* child)
+{
+    return child->lib->frameTime;
+}
+
+void libChildSetDataMode(LibChild* lib, enum childDataModes mode)
+{
+    lib->dataMode = mode;
+}
+
+void* libChildDataRetain(Child* child)
+{
+    struct rxBlock* block = child->lib->deliverBlock;
+
+    /* Only valid from within the childData callback */
+    if(block) {
+        block->refs++;
+    }
+
+    return block;
+}
+
+void libChildDataRelease(void* token)
+{
+    rxBlockRelease((struct rxBlock*)token);
+}
+
 #ifdef __linux__
 #define GETENV secure_getenv
 #else
@@ -25,6 +25,7 @@
  */
 
 #include <signal.h>
+#include <stddef.h>
 
 #ifndef SRC_LIBCHILD_H_
 #define SRC_LIBCHILD_H_
@@ -40,24 +41,258 @@ typedef struct Child Child;
 enum childStates {
     CHILD_STARTING = 0,
     CHILD_STARTED = 1,
-    CHILD_TERMINATED = 2
+    CHILD_TERMINATED = 2,
+    /* Waiting in the worker for a limit of libChildSetLimits, comes before CHILD_STARTED */
+    CHILD_QUEUED = 3
+};
+
+enum childDataModes {
+    /* childData gets a terminated copy of the output */
+    CHILD_DATA_COPY = 0,
+    /* childData gets a pointer into the receive buffer, use libChildDataRetain to keep it */
+    CHILD_DATA_ZEROCOPY = 1,
+    /* No callbacks, libChildPollEvents returns what happened. The output of every child is captured. */
+    CHILD_DATA_EVENTS = 2
+};
+
+enum libChildEventTypes {
+    /* What stateChange would have been called with */
+    LIBCHILD_EVENT_STATE = 1,
+    /* What childData would have been called with */
+    LIBCHILD_EVENT_DATA = 2,
+    /* What signalReceived would have been called with */
+    LIBCHILD_EVENT_SIGNAL = 3,
+    /* What usageSampled would have been called with */
+    LIBCHILD_EVENT_USAGE = 4
+};
+
+/* Resource use of a running child as sampled by the worker, summed over the stages of a pipeline.
+ * Descendants the child starts itself are not included. */
+struct childUsage {
+    /* Totals since it started */
+    unsigned long long cpuNs;
+    unsigned long long readBytes;
+    unsigned long long writeBytes;
+    unsigned long long majorFaults;
+    /* At the time of the sample */
+    unsigned long long rssBytes;
+    unsigned int       threads;
+    /* CLOCK_MONOTONIC ns of the sample */
+    unsigned long long sampled;
+};
+
+struct libChildEvent {
+    enum libChildEventTypes type;
+    /* NULL for signals */
+    Child*           child;
+    void*            param;
+    enum childStates state;
+    /* Not terminated, points into the receive buffer until the next libChildPollEvents call */
+    char*            data;
+    size_t           len;
+    int              isErr;
+    siginfo_t        signal;
+    struct childUsage usage;
+    /* CLOCK_MONOTONIC ns at which the worker saw what caused the event */
+    unsigned long long timestamp;
+};
+
+struct libChildPoolStats {
+    size_t             objectSize;
+    size_t             slabs;
+    size_t             capacity;
+    size_t             inUse;
+    size_t             peak;
+    unsigned long long allocations;
+};
+
+/* Latencies in nanoseconds, bucketed log-linear (about 12% resolution) */
+#define LIBCHILD_HISTOGRAM_BUCKETS 368
+
+struct libChildHistogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[LIBCHILD_HISTOGRAM_BUCKETS];
+};
+
+struct libChildStats {
+    /* Counted by the worker */
+    unsigned long long spawns;
+    unsigned long long spawnFailures;
+    unsigned long long exitsNormal;
+    unsigned long long exitsBySignal;
+    unsigned long long stdoutBytes;
+    unsigned long long stderrBytes;
+    unsigned long long framesSent;
+    unsigned long long workerWakeups;
+    unsigned long long children;
+    /* Requests waiting for a slot */
+    unsigned long long queued;
+    unsigned long long orphansReaped;
+    struct libChildPoolStats processPool;
+    struct libChildHistogram exitToNotified;
+
+    /* Counted by the master */
+    unsigned long long framesReceived;
+    unsigned long long pollCalls;
+    unsigned long long writeStalls;
+    struct libChildHistogram spawnToStarted;
+    /* From the event in the worker to the frame being parsed here, and to it reaching a
+     * callback or being returned by libChildPollEvents */
+    struct libChildHistogram eventToReceived;
+    struct libChildHistogram eventToDelivered;
+};
+
+enum libChildTraceTypes {
+    LIBCHILD_TRACE_EXEC_SUBMIT = 1,
+    LIBCHILD_TRACE_FORK = 2,
+    LIBCHILD_TRACE_CHILD_CREATED = 3,
+    LIBCHILD_TRACE_REAP = 4,
+    LIBCHILD_TRACE_OUTPUT = 5,
+    LIBCHILD_TRACE_SIGNAL_FORWARD = 6,
+    LIBCHILD_TRACE_CLOSE_HANDLE = 7,
+    /* A descendant reparented to the worker was reaped, arg is the job it belonged to */
+    LIBCHILD_TRACE_ORPHAN_REAP = 8
+};
+
+enum libChildTraceSources {
+    LIBCHILD_TRACE_MASTER = 0,
+    LIBCHILD_TRACE_WORKER = 1
+};
+
+/* Record format of libChildTraceDump, timestamps are CLOCK_MONOTONIC nanoseconds */
+struct libChildTraceEvent {
+    unsigned long long timestamp;
+    unsigned long long arg;
+    int                pid;
+    unsigned short     type;
+    unsigned short     source;
+};
+
+enum childExecFlags {
+    /* The child leads its own process group, signals and deadlines reach all of its descendants */
+    CHILD_EXEC_PROCESS_GROUP = 1 << 0,
+    /* Same, but the child also starts a new session */
+    CHILD_EXEC_SESSION = 1 << 1
+};
+
+/* Applied by the worker to stdout and stderr, line by line, before anything is sent to us */
+struct childOutputFilter {
+    /* NULL terminated, a line is forwarded if it contains any of them. NULL or empty forwards every line.
+     * Together the patterns may hold at most 4095 bytes. */
+    char**             patterns;
+    /* Forward only every n-th matching line, 0 or 1 forwards all of them */
+    unsigned int       sampleEvery;
+    /* Stop forwarding after this many bytes, 0 for no limit */
+    unsigned long long byteCap;
+};
+
+/* What the filter did, available once the child has terminated */
+struct childFilterStats {
+    unsigned long long linesForwarded;
+    unsigned long long linesDropped;
+    unsigned long long bytesForwarded;
+    unsigned long long bytesDropped;
+};
+
+/* Initialize with libChildExecOptionsInit, fields may be added in later versions */
+struct childExecOptions {
+    unsigned int flags;
+    /* Wall clock runtime limit in ms, 0 for none. killSignal is sent when it expires. */
+    unsigned int deadlineMs;
+    int          killSignal;
+    /* Time after killSignal before finalSignal is sent, finalSignal 0 disables escalation */
+    unsigned int killGraceMs;
+    int          finalSignal;
+    /* Used as stdin/stdout/stderr of the child instead of /dev/null or the childData pipes,
+     * -1 for the default. They are duplicated, the caller can close them after the call. */
+    int          stdinFd;
+    int          stdoutFd;
+    int          stderrFd;
+    /* NULL to get all output, the filter is copied */
+    const struct childOutputFilter* outputFilter;
+    /* Nonzero: the worker keeps the last tailBytes of stdout and of stderr and sends nothing
+     * while the child runs. libChildFetchTail asks for a copy, one is also sent on exit.
+     * Both arrive through childData. */
+    unsigned int tailBytes;
+    /* When a limit of libChildSetLimits is reached the child is queued, higher priorities
+     * start first. A nonzero tag is limited together with the other children of that tag. */
+    int          priority;
+    unsigned int tag;
+    /* Share of the worker's output bandwidth relative to other children, 0 is the same as 1 */
+    unsigned int outputWeight;
+};
+
+/* One command of a pipeline, its stdout is connected to the stdin of the next one */
+struct childPipelineStage {
+    char*  program;
+    char** argv;
 };
 
 LIBCHILD_H_EXPORT_FUNCTION LibChild* libChildCreateWorker(char* slaveName, char* userName,
                                                      void(*signalReceived)(siginfo_t signal, void* param), void* param);
+LIBCHILD_H_EXPORT_FUNCTION LibChild* libChildCreateWorkerExec(char* slavePath, char* userName,
+                                                     void(*signalReceived)(siginfo_t signal, void* param), void* param);
 LIBCHILD_H_EXPORT_FUNCTION LibChild* libChildInPlace(void(*signalReceived)(siginfo_t signal, void* param), void* param);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildSetDetachable(LibChild* lib, const char* path);
+LIBCHILD_H_EXPORT_FUNCTION LibChild* libChildAttach(const char* path,
+                                                    void(*signalReceived)(siginfo_t signal, void* param), void* param,
+                                                    void(*adopt)(Child* child, void* param));
+LIBCHILD_H_EXPORT_FUNCTION void      libChildDetach(LibChild* lib);
+LIBCHILD_H_EXPORT_FUNCTION LibChild* libChildConnect(const char* path,
+                                                     void(*signalReceived)(siginfo_t signal, void* param), void* param);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildSetLimits(LibChild* lib, unsigned int maxRunning,
+                                                  unsigned int maxPerUser, unsigned int maxPerTag);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildSetSampling(LibChild* lib, unsigned int intervalMs,
+                                                  void(*usageSampled)(Child* child, void* param, const struct childUsage* usage));
+LIBCHILD_H_EXPORT_FUNCTION int       libChildGetUsage(Child* child, struct childUsage* usage);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildSetCallbacks(Child* child,
+                                                  void(*stateChange)(Child* child, void* param, enum childStates state),
+                                                  void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                                                  void* param);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildPid(Child* child);
+LIBCHILD_H_EXPORT_FUNCTION unsigned long long libChildEventTime(Child* child);
 LIBCHILD_H_EXPORT_FUNCTION void      libChildKill(Child* child, int signalId);
 LIBCHILD_H_EXPORT_FUNCTION Child*    libChildExec(LibChild* lib, char* program, char* username,
                                                   char** argv, char** env,
                                                   void(*stateChange)(Child* child, void* param, enum childStates state),
                                                   void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
                                                   void* param);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildExecOptionsInit(struct childExecOptions* options);
+LIBCHILD_H_EXPORT_FUNCTION Child*    libChildExecWithOptions(LibChild* lib, char* program, char* username,
+                                                  char** argv, char** env, const struct childExecOptions* options,
+                                                  void(*stateChange)(Child* child, void* param, enum childStates state),
+                                                  void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                                                  void* param);
+LIBCHILD_H_EXPORT_FUNCTION Child*    libChildExecPipeline(LibChild* lib, char* username, char** env,
+                                                  const struct childPipelineStage* stages, unsigned int count,
+                                                  const struct childExecOptions* options,
+                                                  void(*stateChange)(Child* child, void* param, enum childStates state),
+                                                  void(*childData)(Child* child, void* param, char* buffer, size_t len, int isErr),
+                                                  void* param);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildPipelineStatus(Child* child, unsigned int stage);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildFilterStats(Child* child, struct childFilterStats* stats);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildFetchTail(Child* child);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildTerminate(Child* child, int signalId, unsigned int graceMs, int finalSignal);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildTerminateMany(LibChild* lib, Child** children, size_t count,
+                                                  int signalId, unsigned int graceMs, int finalSignal);
 LIBCHILD_H_EXPORT_FUNCTION int       libChildExitStatus(Child* child);
 LIBCHILD_H_EXPORT_FUNCTION void      libChildFreeHandle(Child* child);
 LIBCHILD_H_EXPORT_FUNCTION int       libChildPoll(LibChild* lib);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildPollEvents(LibChild* lib, struct libChildEvent* events, size_t max);
 LIBCHILD_H_EXPORT_FUNCTION int       libChildGetFd(LibChild* lib);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildWorkerPid(LibChild* lib);
 LIBCHILD_H_EXPORT_FUNCTION void      libChildMain();
 LIBCHILD_H_EXPORT_FUNCTION void      libChildTerminateWorker(LibChild* lib);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildGetPoolStats(LibChild* lib, struct libChildPoolStats* childPool, size_t* receiveArena);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildSetDataMode(LibChild* lib, enum childDataModes mode);
+LIBCHILD_H_EXPORT_FUNCTION void*     libChildDataRetain(Child* child);
+LIBCHILD_H_EXPORT_FUNCTION void      libChildDataRelease(void* token);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildGetStats(LibChild* lib, struct libChildStats* stats);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildTraceEnable(LibChild* lib, unsigned int entries);
+LIBCHILD_H_EXPORT_FUNCTION int       libChildTraceDump(LibChild* lib, int fd);
+LIBCHILD_H_EXPORT_FUNCTION unsigned long long libChildHistogramPercentile(const struct libChildHistogram* histogram, double percentile);
 
 
 #endif /* SRC_LIBCHILD_H_ */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <string.h>
+#include "def.h"
+
+struct poolSlab {
+    struct poolSlab* next;
+};
+
+/* Keep objects aligned like malloc would */
+#define POOL_ALIGN 16
+#define POOL_SLAB_HEADER ((sizeof(struct poolSlab) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+void poolInit(struct objectPool* pool, size_t objectSize, unsigned int perSlab)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if(objectSize < sizeof(void*)) {
+        objectSize = sizeof(void*);
+    }
+    pool->objectSize = (objectSize + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->perSlab = perSlab ? perSlab : 1;
+    pool->stats.objectSize = objectSize;
+}
+
+static int poolGrow(struct objectPool* pool)
+{
+    struct poolSlab* slab = (struct poolSlab*)malloc(POOL_SLAB_HEADER + pool->objectSize * pool->perSlab);
+    if(!slab) return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    /* Thread all new objects on the free list, first object ends up on top */
+    char* objects = (char*)slab + POOL_SLAB_HEADER;
+    for(unsigned int i = pool->perSlab; i > 0; i--) {
+        void** object = (void**)(objects + (i - 1) * pool->objectSize);
+        *object = pool->freeList;
+        pool->freeList = object;
+    }
+
+    pool->stats.slabs++;
+    pool->stats.capacity += pool->perSlab;
+    return 0;
+}
+
+void* poolAlloc(struct objectPool* pool)
+{
+    if(!pool->freeList && poolGrow(pool)) {
+        return NULL;
+    }
+
+    void** object = (void**)pool->freeList;
+    pool->freeList = *object;
+
+    pool->stats.allocations++;
+    pool->stats.inUse++;
+    if(pool->stats.inUse > pool->stats.peak) {
+        pool->stats.peak = pool->stats.inUse;
+    }
+
+    return object;
+}
+
+void poolFree(struct objectPool* pool, void* object)
+{
+    if(!object) return;
+
+    *(void**)object = pool->freeList;
+    pool->freeList = object;
+    pool->stats.inUse--;
+}
+
+void poolDestroy(struct objectPool* pool)
+{
+    struct poolSlab* it = pool->slabs;
+    while(it) {
+        struct poolSlab* next = it->next;
+        free(it);
+        it = next;
+    }
+
+    pool->slabs = NULL;
+    pool->freeList = NULL;
+    pool->stats.slabs = 0;
+    pool->stats.capacity = 0;
+    pool->stats.inUse = 0;
+}
+
+struct arenaChunk {
+    struct arenaChunk* next;
+    size_t  size;
+    size_t  used;
+};
+
+struct arenaMap {
+    struct arenaMap* next;
+    void*   map;
+    size_t  len;
+};
+
+#define ARENA_CHUNK_HEADER ((sizeof(struct arenaChunk) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+#define ARENA_MIN_CHUNK 4096
+
+void arenaInit(struct arena* arena)
+{
+    memset(arena, 0, sizeof(*arena));
+}
+
+static struct arenaChunk* arenaGrow(struct arena* arena, size_t size)
+{
+    /* At least double, so a large message needs few chunks */
+    if(size < ARENA_MIN_CHUNK) {
+        size = ARENA_MIN_CHUNK;
+    }
+    if(size < arena->capacity) {
+        size = arena->capacity;
+    }
+
+    struct arenaChunk* chunk = (struct arenaChunk*)malloc(ARENA_CHUNK_HEADER + size);
+    if(!chunk) return NULL;
+
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    arena->capacity += size;
+
+    return chunk;
+}
+
+void* arenaAlloc(struct arena* arena, size_t size)
+{
+    size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+    /* Only the newest chunk is filled, the older ones are full enough */
+    struct arenaChunk* chunk = arena->chunks;
+    if(!chunk || chunk->size - chunk->used < size) {
+        chunk = arenaGrow(arena, size);
+        if(!chunk) return NULL;
+    }
+
+    void* object = (char*)chunk + ARENA_CHUNK_HEADER + chunk->used;
+    chunk->used += size;
+    return object;
+}
+
+/* The mapping is unmapped on the next reset */
+int arenaAddMap(struct arena* arena, void* map, size_t len)
+{
+    struct arenaMap* entry = (struct arenaMap*)arenaAlloc(arena, sizeof(struct arenaMap));
+    if(!entry) return -1;
+
+    entry->map = map;
+    entry->len = len;
+    entry->next = arena->maps;
+    arena->maps = entry;
+    return 0;
+}
+
+static void arenaFreeChunks(struct arena* arena)
+{
+    struct arenaChunk* it = arena->chunks;
+    while(it) {
+        struct arenaChunk* next = it->next;
+        free(it);
+        it = next;
+    }
+
+    arena->chunks = NULL;
+    arena->capacity = 0;
+}
+
+void arenaReset(struct arena* arena)
+{
+    for(struct arenaMap* it = arena->maps; it; it = it->next) {
+        munmap(it->map, it->len);
+    }
+    arena->maps = NULL;
+
+    if(!arena->chunks) return;
+
+    /* Merge into one chunk, the next message of this size then fits without allocating */
+    if(arena->chunks->next) {
+        size_t capacity = arena->capacity;
+        arenaFreeChunks(arena);
+        arenaGrow(arena, capacity);
+    } else {
+        arena->chunks->used = 0;
+    }
+}
+
+void arenaDestroy(struct arena* arena)
+{
+    arenaReset(arena);
+    arenaFreeChunks(arena);
+}
@@ -29,19 +29,33 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <grp.h>
+#include "def.h"
 
-int changeUser(char* username)
+/* Resolved users are reused for this many seconds before NSS is asked again */
+#define USER_CACHE_TTL 60
+
+static struct userCredentials* userCache = NULL;
+
+static time_t monotonicSeconds()
 {
-    if (getuid() != 0) {
-        return -1;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
 
+static int resolveUser(char* username, struct userCredentials* cred)
+{
     struct passwd pwd, *result;
     int buflen = sysconf(_SC_GETPW_R_SIZE_MAX), retVal;
     char* buf;
 
+    if(buflen <= 0) {
+        buflen = 1024;
+    }
+
     /* Try to get user information */
     for(;;) {
         buf = malloc(buflen);
@@ -56,18 +70,113 @@ int changeUser(char* username)
         }
     }
 
+    /* Only a clean miss means the user does not exist, an NSS error is retried */
+    if(retVal) {
+        free(buf);
+        return -1;
+    }
     if(!result) {
         free(buf);
+        cred->found = 0;
         return 0;
     }
 
     uid_t uid = result->pw_uid;
-    uid_t gid = result->pw_gid;
+    gid_t gid = result->pw_gid;
     free(buf);
 
-    if(setgid(gid) != 0) return -1;
-    if(initgroups(username, gid)) return -1;
-    if(setuid(uid) != 0) return -1;
+    /* Supplementary groups, this is what initgroups would do in the child */
+    int numGroups = 16;
+    gid_t* groups = NULL;
+    for(;;) {
+        gid_t* newGroups = realloc(groups, numGroups * sizeof(gid_t));
+        if(!newGroups) {
+            free(groups);
+            return -1;
+        }
+        groups = newGroups;
 
+        int wanted = numGroups;
+        if(getgrouplist(username, gid, groups, &wanted) >= 0) {
+            numGroups = wanted;
+            break;
+        }
+        numGroups = (wanted > numGroups) ? wanted : numGroups * 2;
+    }
+
+    free(cred->groups);
+    cred->groups = groups;
+    cred->numGroups = numGroups;
+    cred->uid = uid;
+    cred->gid = gid;
+    cred->found = 1;
     return 1;
 }
+
+struct userCredentials* lookupUser(char* username)
+{
+    if (getuid() != 0) {
+        return NULL;
+    }
+
+    time_t now = monotonicSeconds();
+
+    struct userCredentials* it;
+    for(it = userCache; it; it = it->next) {
+        if(!strcmp(it->username, username)) {
+            break;
+        }
+    }
+
+    if(!it) {
+        it = (struct userCredentials*)malloc(sizeof(struct userCredentials));
+        if(!it) return NULL;
+        memset(it, 0, sizeof(*it));
+
+        it->username = strdup(username);
+        if(!it->username) {
+            free(it);
+            return NULL;
+        }
+
+        it->next = userCache;
+        userCache = it;
+    } else if(now - it->resolved < USER_CACHE_TTL) {
+        return it->found ? it : NULL;
+    }
+
+    if(resolveUser(username, it) < 0) {
+        /* Keep the old record if we had one, but retry on the next spawn */
+        return it->found ? it : NULL;
+    }
+    it->resolved = now;
+
+    return it->found ? it : NULL;
+}
+
+int applyUser(struct userCredentials* cred)
+{
+    if(setgroups(cred->numGroups, cred->groups) != 0) return -1;
+    if(setgid(cred->gid) != 0) return -1;
+    if(setuid(cred->uid) != 0) return -1;
+
+    return 1;
+}
+
+int changeUser(char* username)
+{
+    if (getuid() != 0) {
+        return -1;
+    }
+
+    struct userCredentials cred;
+    memset(&cred, 0, sizeof(cred));
+
+    int retVal = resolveUser(username, &cred);
+    if(retVal == 1) {
+        retVal = applyUser(&cred);
+    }
+
+    free(cred.groups);
+    return retVal;
+}
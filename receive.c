@@ -0,0 +1,211 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "def.h"
+
+/* Smallest block we allocate, large enough for many frames per read */
+#define RX_BLOCK_MIN (64 * 1024)
+
+/* Descriptors waiting for their marker byte, a peer sending more is broken */
+#define RX_FDS_MAX 256
+
+void rxBlockRelease(struct rxBlock* block)
+{
+    if(block && !--block->refs) {
+        free(block);
+    }
+}
+
+int rxBlockReserve(struct rxBlock** block, size_t size)
+{
+    /* Nobody else is looking at it, so we can simply reuse it */
+    if(*block && (*block)->refs == 1 && (*block)->size >= size) {
+        return 0;
+    }
+
+    size_t allocSize = (size < RX_BLOCK_MIN) ? RX_BLOCK_MIN : size;
+    struct rxBlock* newBlock = (struct rxBlock*)malloc(sizeof(struct rxBlock) + allocSize);
+    if(!newBlock) return -1;
+
+    newBlock->refs = 1;
+    newBlock->size = allocSize;
+
+    rxBlockRelease(*block);
+    *block = newBlock;
+
+    return 0;
+}
+
+char* rxPeek(struct rxBuffer* rx, size_t len)
+{
+    if(rx->end - rx->start < len) {
+        return NULL;
+    }
+
+    return rx->block->data + rx->start;
+}
+
+void rxConsume(struct rxBuffer* rx, size_t len)
+{
+    rx->start += len;
+}
+
+/* Queues the descriptors that came with the data, they are taken in order as their marker bytes are decoded */
+static int rxKeepFds(struct rxBuffer* rx, struct msghdr* msg)
+{
+    int retVal = (msg->msg_flags & MSG_CTRUNC) ? -1 : 0;
+
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        unsigned int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* data = (int*)CMSG_DATA(cmsg);
+        for(unsigned int i=0; i<n; i++) {
+            fcntl(data[i], F_SETFD, FD_CLOEXEC);
+
+            if(rx->fdCount == rx->fdSize && rx->fdSize < RX_FDS_MAX) {
+                unsigned int newSize = rx->fdSize ? rx->fdSize * 2 : 8;
+                int* newFds = (int*)realloc(rx->fds, newSize * sizeof(int));
+                if(newFds) {
+                    rx->fds = newFds;
+                    rx->fdSize = newSize;
+                }
+            }
+
+            if(rx->fdCount < rx->fdSize) {
+                rx->fds[rx->fdCount++] = data[i];
+            } else {
+                close(data[i]);
+                retVal = -1;
+            }
+        }
+    }
+
+    return retVal;
+}
+
+int rxFill(struct rxBuffer* rx, int fd, size_t wanted)
+{
+    size_t pending = rx->end - rx->start;
+    if(wanted < pending + 1) {
+        wanted = pending + 1;
+    }
+
+    if(!rx->block || rx->block->refs > 1 || rx->block->size < wanted) {
+        /* Someone still references the current block (or it is too small), move to a new one */
+        struct rxBlock* newBlock = NULL;
+        if(rxBlockReserve(&newBlock, wanted)) return -1;
+
+        if(rx->block) {
+            memcpy(newBlock->data, rx->block->data + rx->start, pending);
+            rxBlockRelease(rx->block);
+        }
+
+        rx->block = newBlock;
+        rx->start = 0;
+        rx->end = pending;
+
+    } else if(rx->block->size - rx->end < wanted - pending) {
+        /* Not enough room left at the end, compact */
+        memmove(rx->block->data, rx->block->data + rx->start, pending);
+        rx->start = 0;
+        rx->end = pending;
+
+    } else if(!pending) {
+        rx->start = 0;
+        rx->end = 0;
+    }
+
+    while(1) {
+        /* The kernel hands out the descriptors of one marker byte per call at most */
+        char control[CMSG_SPACE(sizeof(((struct txAttachment*)0)->fds))];
+
+        struct iovec iov;
+        iov.iov_base = rx->block->data + rx->end;
+        iov.iov_len = rx->block->size - rx->end;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t bytesRead = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if(bytesRead < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        if(rxKeepFds(rx, &msg)) {
+            return -1;
+        }
+        if(bytesRead == 0) {
+            return -1;
+        }
+
+        rx->end += bytesRead;
+        return 0;
+    }
+}
+
+/* Takes the descriptors of the marker byte that is being decoded */
+int rxTakeFds(struct rxBuffer* rx, int* fds, unsigned int count)
+{
+    if(rx->fdCount < count) return -1;
+
+    memcpy(fds, rx->fds, count * sizeof(int));
+    rx->fdCount -= count;
+    memmove(rx->fds, rx->fds + count, rx->fdCount * sizeof(int));
+
+    return 0;
+}
+
+void rxFree(struct rxBuffer* rx)
+{
+    for(unsigned int i=0; i<rx->fdCount; i++) {
+        close(rx->fds[i]);
+    }
+    free(rx->fds);
+    rx->fds = NULL;
+    rx->fdCount = 0;
+    rx->fdSize = 0;
+
+    rxBlockRelease(rx->block);
+    rx->block = NULL;
+    rx->start = 0;
+    rx->end = 0;
+}
@@ -24,8 +24,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <setjmp.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -38,24 +40,113 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "def.h"
 
 #ifdef __linux__
 #include <sys/eventfd.h>
+#include <sys/prctl.h>
 #endif
 
 #ifndef NSIG
 #define NSIG (_SIGMAX + 1)
 #endif
 
+struct pipelineStage {
+    pid_t  pid;
+    int    running;
+    int    status;
+};
+
+/* Last bytes of a stream, data is allocated on first use */
+struct tailRing {
+    char*  data;
+    size_t head;
+    size_t len;
+};
+
+struct execStage {
+    char*  program;
+    char** argv;
+};
+
+/* An exec or pipeline request, kept from the command until it is forked */
+struct execRequest {
+    /* Pending queue, highest priority first and in arrival order within a priority */
+    struct execRequest* next;
+    struct execRequest* prev;
+    struct childProcess* child;
+
+    int    pipeline;
+    int    silent;
+    char*  userName;
+    struct userCredentials* cred;
+    char** env;
+    struct slaveExecOptions options;
+    int    stdio[3];
+    struct filterState* filter;
+    /* Holds this request and everything decoded for it */
+    struct arena* arena;
+    unsigned int count;
+    struct execStage stages[];
+};
+
+/* Running jobs of one user or tag, only kept while nonzero */
+struct runCount {
+    struct runCount* next;
+    int    isTag;
+    unsigned int key;
+    unsigned int running;
+};
+
+/* Frames of one loop iteration, sent before polling again */
+struct txLane {
+    char*  data;
+    size_t len;
+    size_t size;
+};
+
+/* A master talking to us: the one that started us, or one that connected to the socket */
+struct slaveClient {
+    struct slaveClient* next;
+    int    socket;
+    /* Control frames go out ahead of the output of the children */
+    struct txLane control;
+    struct txLane bulk;
+    /* Counts flushes, a child whose output is still in the bulk lane has the current value */
+    unsigned long long bulkEpoch;
+    /* Flushed frames the socket did not take yet, sent once it polls writable */
+    struct txLane unsent;
+    size_t unsentStart;
+    /* Commands are only handled once all of one is here, so a slow client cannot stall us */
+    struct rxBuffer rx;
+    /* Writing failed, it is dropped before the next poll */
+    int    dead;
+    unsigned int children;
+    uid_t  uid;
+    /* Resource sampling of its children, sampleMs 0 when off */
+    struct timerEntry sampleTimer;
+    unsigned int sampleMs;
+};
+
 struct childProcess {
     struct childProcess* next;
     struct childProcess* prev;
+    struct childProcess* hashNext;
+    struct childProcess* idNext;
+
+    /* Where its frames go, NULL while it waits to be adopted */
+    struct slaveClient* client;
 
     int    running;
     pid_t  pid;
+    /* Process group led by the child, 0 when it shares the worker's group */
+    pid_t  pgid;
+    /* Its handle is gone but not the rest of its group, the record stays until that is */
+    int    retired;
+    unsigned int orphansReaped;
 
     void*  echo;
 
@@ -64,141 +155,2278 @@ struct childProcess {
     int    silent;
 
     int    status;
+    uint64_t reaped;
+
+    struct filterState* filter;
+
+    /* With tailBytes set output is kept here instead of being sent, one ring per stream */
+    struct tailRing tail[2];
+    unsigned int tailBytes;
+
+    /* Only for pipelines, pid is then the first stage and running stays set until all have exited */
+    struct pipelineStage* stages;
+    unsigned int stageCount;
+    unsigned int stagesRunning;
+
+    /* Output scheduling: bytes it may still read this round, deficit round-robin */
+    long long deficit;
+    unsigned int weight;
+    unsigned long long round;
+    int    backlogged;
+    unsigned long long bulkEpoch;
+
+    /* Set while it waits in the queue for a slot */
+    struct execRequest* request;
+    /* What it counts against while it runs */
+    uid_t  uid;
+    unsigned int tag;
+    int    holdsSlot;
+
+    /* Totals of the previous resource sample, records carry the difference */
+    struct slaveUsage lastUsage;
+
+    /* Deadline and kill escalation */
+    struct timerEntry timer;
+    int    killSignal;
+    unsigned int killGraceMs;
+    int    finalSignal;
 };
 
+#define PID_HASH_SIZE 4096
+
 typedef struct {
     pid_t  intermediatePid;
     pid_t  grpId;
     int    chldFd[2];
-    int    socket;
+    struct slaveClient* clients;
+    unsigned int clientCount;
+    /* Client whose command is being handled */
+    struct slaveClient* current;
     struct childProcess* firstProcess;
+    struct objectPool processPool;
+    struct libChildStats stats;
+    struct traceRing trace;
+    struct timerHeap timers;
+    /* Scratch space for filtered output */
+    struct filterOutput filterOut;
+    /* Children by pid, so reaping does not walk the whole list */
+    struct childProcess* pidHash[PID_HASH_SIZE];
+    /* Children by address, a client may only name its own */
+    struct childProcess* idHash[PID_HASH_SIZE];
+    /* Children with their own process group, only then orphans need attributing */
+    unsigned int groupLeaders;
+    unsigned int retiredGroups;
+    /* Output scheduling rounds, one per poll */
+    unsigned long long round;
+    /* When what is being handled happened, frames carry it */
+    uint64_t eventTime;
+    /* Detachable or serving: losing a client does not end us, others connect here */
+    int    listenFd;
+    char*  listenPath;
+    jmp_buf dropped;
+    int    quitting;
+    /* Serving many clients, each one only sees its own children */
+    int    server;
+    unsigned int maxClients;
+    unsigned int maxChildren;
+    /* Admission: requests wait in the queue while a limit is reached */
+    struct slaveLimits limits;
+    struct execRequest* queueFirst;
+    struct execRequest* queueLast;
+    unsigned int runningJobs;
+    struct runCount* runCounts;
+    /* A slot was freed or the limits changed, the queue is looked at again */
+    int    slotsChanged;
+    /* Arenas of finished requests kept for the next ones, and the request being decoded */
+    struct arena* freeArenas;
+    unsigned int freeArenaCount;
+    struct execRequest* decoding;
+    /* Resource sampling reads below this, the records of one pass are gathered here */
+    int    procFd;
+    long   clockTicks;
+    long   pageSize;
+    struct slaveUsageRecord* usageOut;
+    unsigned int usageSize;
 } SlaveGlobal;
 
-static void slaveExit(SlaveGlobal* lib)
+static SlaveGlobal lib;
+
+/* Number of process records allocated at once */
+#define PROCESS_POOL_SLAB 64
+
+/* Decoding arenas kept around, more are only needed while requests queue up */
+#define ARENA_CACHE 16
+/* Larger arenas are freed after use, one huge request must not stay pinned in the cache */
+#define ARENA_CACHE_BYTES (64 * 1024)
+
+/* Output a child may read per round, times its weight */
+#define OUTPUT_QUANTUM 4096
+
+/* Flush early above this, larger payloads are written directly */
+#define TX_COALESCE_MAX (64 * 1024)
+
+/* Above this much unsent data a client is not read from, and the output of its children stays in the pipes */
+#define CLIENT_UNSENT_MAX (1024 * 1024)
+
+/* Returns what the socket took without blocking, or -1 if the client is gone */
+static ssize_t sendSome(int fd, const char* data, size_t len)
+{
+    size_t sent = 0;
+    while(sent < len) {
+        ssize_t bytesWritten = send(fd, data + sent, len - sent, 0);
+        if(bytesWritten < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        sent += bytesWritten;
+    }
+
+    return sent;
+}
+
+/* What the socket does not take now waits in the unsent buffer, nothing may overtake that */
+static void clientSend(struct slaveClient* client, const char* data, size_t len)
+{
+    if(client->dead) return;
+
+    struct txLane* unsent = &client->unsent;
+    if(client->unsentStart == unsent->len) {
+        client->unsentStart = unsent->len = 0;
+
+        ssize_t sent = sendSome(client->socket, data, len);
+        if(sent < 0) {
+            client->dead = 1;
+            return;
+        }
+        data += sent;
+        len -= sent;
+        if(!len) return;
+    }
+
+    if(unsent->len + len > unsent->size) {
+        memmove(unsent->data, unsent->data + client->unsentStart, unsent->len - client->unsentStart);
+        unsent->len -= client->unsentStart;
+        client->unsentStart = 0;
+    }
+
+    if(unsent->len + len > unsent->size) {
+        size_t newSize = unsent->size ? unsent->size : TX_COALESCE_MAX;
+        while(newSize < unsent->len + len) {
+            newSize *= 2;
+        }
+
+        char* newData = realloc(unsent->data, newSize);
+        if(!newData) {
+            client->dead = 1;
+            return;
+        }
+        unsent->data = newData;
+        unsent->size = newSize;
+    }
+
+    memcpy(unsent->data + unsent->len, data, len);
+    unsent->len += len;
+}
+
+/* The socket polled writable */
+static void clientDrain(struct slaveClient* client)
+{
+    if(client->dead || client->unsentStart == client->unsent.len) return;
+
+    ssize_t sent = sendSome(client->socket, client->unsent.data + client->unsentStart,
+                            client->unsent.len - client->unsentStart);
+    if(sent < 0) {
+        client->dead = 1;
+        return;
+    }
+
+    client->unsentStart += sent;
+    if(client->unsentStart == client->unsent.len) {
+        client->unsentStart = client->unsent.len = 0;
+    }
+}
+
+static int clientBacklogged(struct slaveClient* client)
+{
+    return client->unsent.len - client->unsentStart > CLIENT_UNSENT_MAX;
+}
+
+static void laneFlush(struct slaveClient* client, struct txLane* lane)
+{
+    size_t len = lane->len;
+    lane->len = 0;
+    if(len) {
+        clientSend(client, lane->data, len);
+    }
+}
+
+static void clientFlush(struct slaveClient* client)
+{
+    laneFlush(client, &client->control);
+    laneFlush(client, &client->bulk);
+    client->bulkEpoch++;
+}
+
+/* Only fails when out of memory, frames for a client that is gone are dropped */
+static int laneWrite(struct slaveClient* client, int bulk, const void* data, size_t len)
+{
+    if(!client || client->dead) return 0;
+
+    struct txLane* lane = bulk ? &client->bulk : &client->control;
+    if(lane->len + len > TX_COALESCE_MAX) {
+        clientFlush(client);
+        if(len >= TX_COALESCE_MAX) {
+            clientSend(client, data, len);
+            return 0;
+        }
+    }
+
+    if(lane->len + len > lane->size) {
+        char* newData = realloc(lane->data, TX_COALESCE_MAX);
+        if(!newData) return -1;
+        lane->data = newData;
+        lane->size = TX_COALESCE_MAX;
+    }
+
+    memcpy(lane->data + lane->len, data, len);
+    lane->len += len;
+    return 0;
+}
+
+static int laneWriteVariable(struct slaveClient* client, int bulk, const void* data, unsigned int len)
+{
+    if(laneWrite(client, bulk, &len, sizeof(len))) return -1;
+    return laneWrite(client, bulk, data, len);
+}
+
+static int laneResponse(struct slaveClient* client, int bulk, struct slaveResponse* response)
+{
+    lib.stats.framesSent++;
+    response->timestamp = lib.eventTime;
+    return laneWrite(client, bulk, response, sizeof(*response));
+}
+
+static int clientWrite(struct slaveClient* client, const void* data, size_t len)
+{
+    return laneWrite(client, 0, data, len);
+}
+
+static int clientWriteVariable(struct slaveClient* client, const void* data, unsigned int len)
+{
+    return laneWriteVariable(client, 0, data, len);
+}
+
+static int sendResponse(struct slaveClient* client, struct slaveResponse* response)
+{
+    return laneResponse(client, 0, response);
+}
+
+/* Frames about a child must not overtake its output, while some is buffered they queue behind it */
+static int childBulk(struct childProcess* it)
+{
+    return it->client && it->bulkEpoch == it->client->bulkEpoch;
+}
+
+/* Signals the child, or its whole process group if it leads one */
+static int signalChild(struct childProcess* child, int sig)
+{
+    if(child->pgid) {
+        if(!kill(-child->pgid, sig)) {
+            return 0;
+        }
+        /* A new session may not be set up yet */
+        if(errno != ESRCH || !child->running) {
+            return -1;
+        }
+    }
+
+    return kill(child->pid, sig);
+}
+
+/* The child or something in its process group is still around */
+static int childAlive(struct childProcess* child)
+{
+    if(child->running) return 1;
+    return child->pgid && !kill(-child->pgid, 0);
+}
+
+static void releaseChild(SlaveGlobal* lib, struct childProcess* child)
+{
+    free(child->stages);
+    filterDestroy(child->filter);
+    free(child->tail[0].data);
+    free(child->tail[1].data);
+    poolFree(&lib->processPool, child);
+}
+
+static void closePipe(int fd)
+{
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+static void removeChild(struct childProcess* child);
+static void retireChild(struct childProcess* child);
+
+/* Without a client the children wait to be adopted, unless we serve many: then nobody
+ * else may take them and they are killed. */
+static void dropClient(SlaveGlobal* lib, struct slaveClient* client)
+{
+    struct slaveClient** link = &lib->clients;
+    while(*link != client) {
+        link = &(*link)->next;
+    }
+    *link = client->next;
+    lib->clientCount--;
+
+    timerCancel(&lib->timers, &client->sampleTimer);
+    close(client->socket);
+    free(client->control.data);
+    free(client->bulk.data);
+    free(client->unsent.data);
+    rxFree(&client->rx);
+    free(client);
+
+    struct childProcess* it = lib->firstProcess;
+    while(it) {
+        struct childProcess* next = it->next;
+        if(it->client == client) {
+            it->client = NULL;
+            if(lib->server) {
+                closePipe(it->pipe_out);
+                closePipe(it->pipe_err);
+                it->pipe_out = it->pipe_err = -1;
+                if(childAlive(it)) {
+                    signalChild(it, SIGKILL);
+                }
+                if(!it->running) {
+                    retireChild(it);
+                }
+            }
+        }
+        it = next;
+    }
+}
+
+static void releaseArena(struct arena* arena)
+{
+    if(lib.freeArenaCount >= ARENA_CACHE || arena->capacity > ARENA_CACHE_BYTES) {
+        arenaDestroy(arena);
+        free(arena);
+        return;
+    }
+
+    arenaReset(arena);
+    arena->next = lib.freeArenas;
+    lib.freeArenas = arena;
+    lib.freeArenaCount++;
+}
+
+static void freeRequest(struct execRequest* req);
+
+static void slaveExit(SlaveGlobal* lib)
+{
+    /* Only the connection that failed is lost, we carry on with the others */
+    if(lib->listenFd >= 0 && !lib->quitting && lib->current) {
+        struct slaveClient* client = lib->current;
+        lib->current = NULL;
+        if(lib->decoding) {
+            freeRequest(lib->decoding);
+            lib->decoding = NULL;
+        }
+        dropClient(lib, client);
+        longjmp(lib->dropped, 1);
+    }
+
+    if(lib->listenPath) {
+        unlink(lib->listenPath);
+    }
+
+    /* Kill everything first so the children die in parallel, then reap them */
+    for(struct childProcess* it = lib->firstProcess; it; it = it->next) {
+        if(it->pipe_out >= 0) {
+            close(it->pipe_out);
+        }
+        if(it->pipe_err >= 0) {
+            close(it->pipe_err);
+        }
+
+        if(it->running || it->pgid) {
+            signalChild(it, SIGKILL);
+        }
+    }
+
+    struct childProcess* it = lib->firstProcess;
+    while(it) {
+        if(it->running) {
+            while(waitpid(it->pid, &it->status, 0) < 0 && errno == EINTR) {}
+
+            /* Try to write something to the master, it may still be listening... */
+            struct slaveResponse response;
+            memset(&response, 0, sizeof(response));
+            response.result = SLAVE_RESULT_CHILD_DIED;
+            response.paramChildProcess = it;
+            response.paramInteger = it->status;
+            response.masterEcho = it->echo;
+
+            laneResponse(it->client, childBulk(it), &response);
+        }
+        struct childProcess* next = it->next;
+        releaseChild(lib, it);
+        it = next;
+    }
+
+    /* Whatever got reparented to us */
+    while(waitpid(-1, NULL, WNOHANG) > 0) {}
+
+    for(struct slaveClient* client = lib->clients; client; client = client->next) {
+        clientFlush(client);
+
+        /* The master that started us reads until we are gone, a server does not wait for anyone */
+        if(!lib->server) {
+            int flags = fcntl(client->socket, F_GETFL);
+            if(flags >= 0) {
+                fcntl(client->socket, F_SETFL, flags & ~O_NONBLOCK);
+            }
+        }
+        clientDrain(client);
+        close(client->socket);
+    }
+    _exit (EXIT_FAILURE);
+}
+
+static void detach(int silent)
+{
+    umask(0);
+    int retVal = chdir("/");
+    (void)retVal;
+
+    fclose(stdin);
+    fclose(stdout);
+    fclose(stderr);
+
+    int fd = open("/dev/null", O_RDONLY);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+
+    if(silent) {
+        fd = open("/dev/null", O_RDWR);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+}
+
+static void tailAppend(struct childProcess* it, int isErr, const char* data, size_t len)
+{
+    struct tailRing* ring = &it->tail[isErr];
+    size_t size = it->tailBytes;
+
+    /* Without memory for the ring the output is lost, the child and the worker carry on */
+    if(!ring->data) {
+        ring->data = malloc(size);
+        if(!ring->data) return;
+    }
+
+    if(len > size) {
+        data += len - size;
+        len = size;
+    }
+
+    size_t first = size - ring->head;
+    if(first > len) first = len;
+    memcpy(ring->data + ring->head, data, first);
+    memcpy(ring->data, data + first, len - first);
+
+    ring->head = (ring->head + len) % size;
+    ring->len += len;
+    if(ring->len > size) ring->len = size;
+}
+
+static int tailWrite(struct childProcess* it, int bulk, struct tailRing* ring)
+{
+    size_t size = it->tailBytes;
+    size_t start = (ring->head + size - ring->len) % size;
+    size_t first = size - start;
+    if(first > ring->len) first = ring->len;
+
+    if(laneWrite(it->client, bulk, ring->data + start, first)) return -1;
+    return laneWrite(it->client, bulk, ring->data, ring->len - first);
+}
+
+/* Sends a copy of both rings, stdout first. The buffers are not emptied. */
+static void sendTail(SlaveGlobal* lib, struct childProcess* it)
+{
+    if(!it->tail[0].len && !it->tail[1].len) return;
+
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = SLAVE_RESULT_TAIL;
+    response.paramChildProcess = it;
+    response.masterEcho = it->echo;
+    response.paramInteger = it->tail[0].len;
+
+    unsigned int len = it->tail[0].len + it->tail[1].len;
+    int bulk = childBulk(it);
+    if(laneResponse(it->client, bulk, &response) ||
+       laneWrite(it->client, bulk, &len, sizeof(len)) ||
+       tailWrite(it, bulk, &it->tail[0]) ||
+       tailWrite(it, bulk, &it->tail[1])) {
+        slaveExit(lib);
+    }
+}
+
+static void notifyDead(SlaveGlobal* lib, struct childProcess* it)
+{
+    /* Its master has let go of it already */
+    if(it->retired) return;
+
+    /* Sent once a new master has adopted the child, nobody will in server mode */
+    if(!it->client) {
+        if(lib->server && !it->running) {
+            retireChild(it);
+        }
+        return;
+    }
+    if(it->running || it->request) return;
+    if(!it->silent) {
+        if(it->pipe_out >= 0) return;
+        if(it->pipe_err >= 0) return;
+    }
+
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    if(it->stages) {
+        int status[PIPELINE_MAX_STAGES];
+        for(unsigned int i=0; i<it->stageCount; i++) {
+            status[i] = it->stages[i].status;
+        }
+
+        response.result = SLAVE_RESULT_PIPELINE_STATUS;
+        response.paramChildProcess = it;
+        response.masterEcho = it->echo;
+        if(laneResponse(it->client, childBulk(it), &response) ||
+           laneWriteVariable(it->client, childBulk(it), status, it->stageCount * sizeof(int))) {
+            slaveExit(lib);
+        }
+    }
+
+    if(it->tailBytes) {
+        sendTail(lib, it);
+    }
+
+    if(it->filter) {
+        response.result = SLAVE_RESULT_FILTER_STATS;
+        response.paramChildProcess = it;
+        response.masterEcho = it->echo;
+        if(laneResponse(it->client, childBulk(it), &response) ||
+           laneWriteVariable(it->client, childBulk(it), &it->filter->stats, sizeof(it->filter->stats))) {
+            slaveExit(lib);
+        }
+    }
+
+    response.result = SLAVE_RESULT_CHILD_DIED;
+    response.paramChildProcess = it;
+    response.masterEcho = it->echo;
+    response.paramInteger = it->status;
+
+    histogramRecord(&lib->stats.exitToNotified, libChildNow() - it->reaped);
+
+    if(laneResponse(it->client, childBulk(it), &response)) {
+        slaveExit(lib);
+    }
+}
+
+#define FOREACH_CHILD(lib,it)   for(struct childProcess* it = (lib)->firstProcess; it; it = it->next)
+
+static void signalHandler(int sig, siginfo_t *siginfo, void *context)
+{
+    int retVal = send(lib.chldFd[1], siginfo, sizeof(*siginfo), 0);
+    (void)retVal;
+}
+
+static void sendData(struct childProcess* it, int isErr, const char* data, size_t len)
+{
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = isErr ? SLAVE_RESULT_CHILD_STDERR_DATA : SLAVE_RESULT_CHILD_STDOUT_DATA;
+    response.masterEcho = it->echo;
+
+    if(laneResponse(it->client, 1, &response)) {
+        slaveExit(&lib);
+    }
+    if(laneWriteVariable(it->client, 1, data, len)) {
+        slaveExit(&lib);
+    }
+    if(it->client) {
+        it->bulkEpoch = it->client->bulkEpoch;
+    }
+}
+
+/* Filtered output goes to the master, or to the tail buffer if the child keeps one */
+static void forwardOutput(struct childProcess* it, int isErr, const char* data, size_t len)
+{
+    if(it->tailBytes) {
+        tailAppend(it, isErr, data, len);
+    } else {
+        sendData(it, isErr, data, len);
+    }
+}
+
+/* Sends output to the master, through the filter if the child has one */
+static void sendOutput(struct childProcess* it, int isErr, const char* data, size_t len)
+{
+    if(it->filter) {
+        lib.filterOut.len = 0;
+        if(filterFeed(it->filter, isErr, data, len, &lib.filterOut)) slaveExit(&lib);
+        if(!lib.filterOut.len) return;
+
+        data = lib.filterOut.data;
+        len = lib.filterOut.len;
+    }
+
+    forwardOutput(it, isErr, data, len);
+}
+
+static void filterFlush(struct childProcess* it, int isErr)
+{
+    if(!it->filter) return;
+
+    lib.filterOut.len = 0;
+    if(filterFinish(it->filter, isErr, &lib.filterOut)) slaveExit(&lib);
+    if(lib.filterOut.len) {
+        forwardOutput(it, isErr, lib.filterOut.data, lib.filterOut.len);
+    }
+}
+
+static void pipeClosed(int fd)
+{
+    FOREACH_CHILD(&lib, it) {
+        if(it->pipe_out == fd) {
+            filterFlush(it, 0);
+            close(it->pipe_out);
+            it->pipe_out = -1;
+            notifyDead(&lib, it);
+            break;
+        }
+        if(it->pipe_err == fd) {
+            filterFlush(it, 1);
+            close(it->pipe_err);
+            it->pipe_err = -1;
+            notifyDead(&lib, it);
+            break;
+        }
+    }
+}
+
+/* Reads what the budget of the child allows this round. Every ready child gets its quantum
+ * per round, so one that produces a lot cannot crowd out the others. A child that empties
+ * its pipes does not save up budget. */
+static void readOutput(struct childProcess* it, int fd)
+{
+    int isErr = (it->pipe_err == fd);
+
+    if(it->round != lib.round) {
+        it->round = lib.round;
+        if(!it->backlogged) {
+            it->deficit = 0;
+        }
+        it->deficit += OUTPUT_QUANTUM * it->weight;
+        it->backlogged = 0;
+    }
+
+    while(it->deficit > 0) {
+        char buffer[OUTPUT_QUANTUM];
+        size_t wanted = (it->deficit < (long long)sizeof(buffer)) ? it->deficit : sizeof(buffer);
+        ssize_t readLen = read(fd, buffer, wanted);
+        lib.eventTime = libChildNow();
+        if(readLen == 0) {
+            pipeClosed(fd);
+            return;
+        }
+        if(readLen < 0) {
+            if(errno == EINTR) continue;
+            /* Empty for now, or gone: then it hangs up next round */
+            return;
+        }
+
+        if(isErr) {
+            lib.stats.stderrBytes += readLen;
+        } else {
+            lib.stats.stdoutBytes += readLen;
+        }
+        it->deficit -= readLen;
+
+        TRACE(&lib.trace, output, LIBCHILD_TRACE_OUTPUT, it->pid, readLen);
+        sendOutput(it, isErr, buffer, readLen);
+
+        if((size_t)readLen < wanted) {
+            return;
+        }
+    }
+
+    /* Used it all, there may be more */
+    it->backlogged = 1;
+}
+
+static void childTimerExpired(struct timerEntry* timer)
+{
+    struct childProcess* child = CONTAINER_OF(timer, struct childProcess, timer);
+    if(!childAlive(child)) return;
+
+    if(child->killSignal) {
+        signalChild(child, child->killSignal);
+        child->killSignal = 0;
+
+        /* Give it some time before escalating */
+        if(child->finalSignal) {
+            timerArm(&lib.timers, &child->timer, libChildNow() + child->killGraceMs * 1000000ULL);
+        }
+    } else if(child->finalSignal) {
+        signalChild(child, child->finalSignal);
+        child->finalSignal = 0;
+    }
+}
+
+static void cancelRequest(struct childProcess* child, int sig);
+
+static void terminateChild(struct childProcess* child, struct slaveTerminate* terminate)
+{
+    if(child->request) {
+        cancelRequest(child, terminate->signal ? terminate->signal : terminate->finalSignal);
+        return;
+    }
+    if(!childAlive(child)) return;
+
+    /* Escalates through the same timer as the deadline, this replaces it */
+    child->killSignal = terminate->signal;
+    child->killGraceMs = terminate->graceMs;
+    child->finalSignal = terminate->finalSignal;
+    childTimerExpired(&child->timer);
+}
+
+#ifdef __linux__
+/* Reads /proc/<pid>/<name>, returns its length or -1 */
+static ssize_t readProcFile(pid_t pid, const char* name, char* buffer, size_t size)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%d/%s", (int)pid, name);
+
+    int fd = openat(lib.procFd, path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+
+    ssize_t len;
+    do {
+        len = read(fd, buffer, size - 1);
+    } while(len < 0 && errno == EINTR);
+    close(fd);
+
+    if(len < 0) return -1;
+    buffer[len] = 0;
+    return len;
+}
+
+static unsigned long long procField(const char* buffer, const char* name)
+{
+    const char* field = strstr(buffer, name);
+    if(!field) return 0;
+
+    return strtoull(field + strlen(name), NULL, 10);
+}
+
+/* Adds the counters of one process, one that is gone adds nothing */
+static void sampleProcess(pid_t pid, struct slaveUsage* usage)
+{
+    char buffer[1024];
+
+    if(readProcFile(pid, "stat", buffer, sizeof(buffer)) > 0) {
+        /* The command name can contain anything, the fields we want come after its closing parenthesis */
+        char* fields = strrchr(buffer, ')');
+        unsigned long long majorFaults, userTicks, systemTicks;
+        long threads, rssPages;
+        if(fields && sscanf(fields + 1, " %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu %*s %llu %llu %*s %*s %*s %*s %ld %*s %*s %*s %ld",
+                            &majorFaults, &userTicks, &systemTicks, &threads, &rssPages) == 5) {
+            usage->cpuNs += (userTicks + systemTicks) * 1000000000ULL / lib.clockTicks;
+            usage->majorFaults += majorFaults;
+            usage->threads += threads;
+            usage->rssBytes += (unsigned long long)rssPages * lib.pageSize;
+        }
+    }
+
+    /* Only readable for processes we may trace, the counters then stay 0 */
+    if(readProcFile(pid, "io", buffer, sizeof(buffer)) > 0) {
+        usage->readBytes += procField(buffer, "\nread_bytes:");
+        usage->writeBytes += procField(buffer, "\nwrite_bytes:");
+    }
+}
+
+static uint64_t usageDelta(uint64_t now, uint64_t last)
+{
+    /* A pipeline stage that exited takes its totals with it */
+    return now > last ? now - last : 0;
+}
+
+/* One pass over the children of a client, a single frame carries those that changed */
+static void sampleClient(struct slaveClient* client)
+{
+    unsigned int count = 0;
+
+    FOREACH_CHILD(&lib, it) {
+        /* A queued one has no process yet, one that exited may have been reported dead already */
+        if(it->client != client || !it->running || it->request) continue;
+
+        struct slaveUsage now;
+        memset(&now, 0, sizeof(now));
+        if(it->stages) {
+            for(unsigned int i=0; i<it->stageCount; i++) {
+                if(it->stages[i].running) {
+                    sampleProcess(it->stages[i].pid, &now);
+                }
+            }
+        } else {
+            sampleProcess(it->pid, &now);
+        }
+
+        struct slaveUsageRecord record;
+        record.masterEcho = it->echo;
+        record.usage.cpuNs = usageDelta(now.cpuNs, it->lastUsage.cpuNs);
+        record.usage.readBytes = usageDelta(now.readBytes, it->lastUsage.readBytes);
+        record.usage.writeBytes = usageDelta(now.writeBytes, it->lastUsage.writeBytes);
+        record.usage.majorFaults = usageDelta(now.majorFaults, it->lastUsage.majorFaults);
+        record.usage.rssBytes = now.rssBytes;
+        record.usage.threads = now.threads;
+
+        int changed = record.usage.cpuNs || record.usage.readBytes || record.usage.writeBytes ||
+                      record.usage.majorFaults || now.rssBytes != it->lastUsage.rssBytes ||
+                      now.threads != it->lastUsage.threads;
+        if(!changed) {
+            it->lastUsage = now;
+            continue;
+        }
+
+        /* Out of memory the rest waits for the next sample, their usage adds up until then */
+        if(count == lib.usageSize) {
+            unsigned int newSize = lib.usageSize ? lib.usageSize * 2 : 64;
+            struct slaveUsageRecord* newOut = realloc(lib.usageOut, newSize * sizeof(struct slaveUsageRecord));
+            if(!newOut) break;
+
+            lib.usageOut = newOut;
+            lib.usageSize = newSize;
+        }
+        it->lastUsage = now;
+        lib.usageOut[count++] = record;
+    }
+
+    if(!count) return;
+
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = SLAVE_RESULT_USAGE;
+    if(sendResponse(client, &response) ||
+       clientWriteVariable(client, lib.usageOut, count * sizeof(struct slaveUsageRecord))) {
+        slaveExit(&lib);
+    }
+}
+
+static void sampleTimerExpired(struct timerEntry* timer)
+{
+    struct slaveClient* client = CONTAINER_OF(timer, struct slaveClient, sampleTimer);
+
+    uint64_t now = libChildNow();
+    lib.eventTime = now;
+    sampleClient(client);
+
+    /* Keep the phase, unless we fell behind by a whole interval */
+    uint64_t interval = client->sampleMs * 1000000ULL;
+    uint64_t next = timer->expires + interval;
+    if(next <= now) {
+        next = now + interval;
+    }
+    if(timerArm(&lib.timers, timer, next)) slaveExit(&lib);
+}
+#endif
+
+static unsigned int pidHashIndex(pid_t pid)
+{
+    return (unsigned int)pid & (PID_HASH_SIZE - 1);
+}
+
+static void pidHashInsert(struct childProcess* child)
+{
+    struct childProcess** bucket = &lib.pidHash[pidHashIndex(child->pid)];
+    child->hashNext = *bucket;
+    *bucket = child;
+}
+
+static void pidHashRemove(struct childProcess* child)
+{
+    struct childProcess** it = &lib.pidHash[pidHashIndex(child->pid)];
+    while(*it) {
+        if(*it == child) {
+            *it = child->hashNext;
+            return;
+        }
+        it = &(*it)->hashNext;
+    }
+}
+
+/* Newest child with this pid, pids of closed handles may have been reused */
+static struct childProcess* pidHashFind(pid_t pid, int running)
+{
+    for(struct childProcess* it = lib.pidHash[pidHashIndex(pid)]; it; it = it->hashNext) {
+        if(it->pid == pid && (!running || it->running)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static unsigned int idHashIndex(void* id)
+{
+    return (unsigned int)((uintptr_t)id / sizeof(struct childProcess)) & (PID_HASH_SIZE - 1);
+}
+
+static void idHashInsert(struct childProcess* child)
+{
+    struct childProcess** bucket = &lib.idHash[idHashIndex(child)];
+    child->idNext = *bucket;
+    *bucket = child;
+}
+
+static void idHashRemove(struct childProcess* child)
+{
+    struct childProcess** it = &lib.idHash[idHashIndex(child)];
+    while(*it) {
+        if(*it == child) {
+            *it = child->idNext;
+            return;
+        }
+        it = &(*it)->idNext;
+    }
+}
+
+/* A handle sent by a client, NULL unless it is a live child that belongs to that client */
+static struct childProcess* findChild(void* id, struct slaveClient* client)
+{
+    for(struct childProcess* it = lib.idHash[idHashIndex(id)]; it; it = it->idNext) {
+        if(it == id) {
+            return (it->client == client) ? it : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void queueRemove(struct execRequest* req);
+static void slotRelease(struct childProcess* child);
+
+static void removeChild(struct childProcess* child)
+{
+    if(child->request) {
+        queueRemove(child->request);
+        freeRequest(child->request);
+        child->request = NULL;
+    }
+    slotRelease(child);
+
+    timerCancel(&lib.timers, &child->timer);
+    pidHashRemove(child);
+    idHashRemove(child);
+    if(child->pgid) {
+        lib.groupLeaders--;
+    }
+    if(child->retired) {
+        lib.retiredGroups--;
+    }
+    if(child->prev) {
+        child->prev->next = child->next;
+    } else {
+        lib.firstProcess = child->next;
+    }
+    if(child->next) {
+        child->next->prev = child->prev;
+    }
+
+    if(child->pipe_out >= 0) {
+        close(child->pipe_out);
+        child->pipe_out = -1;
+    }
+    if(child->pipe_err >= 0) {
+        close(child->pipe_err);
+        child->pipe_err = -1;
+    }
+
+    if(child->client) {
+        child->client->children--;
+    }
+    releaseChild(&lib, child);
+    lib.stats.children--;
+}
+
+/* Drops a child nobody can ask about anymore. While its process group lives on the record is kept,
+ * for the deadline, orphans and slaveExit. */
+static void retireChild(struct childProcess* child)
+{
+    if(child->retired) return;
+
+    if(!childAlive(child)) {
+        removeChild(child);
+        return;
+    }
+
+    /* Nothing is sent about it anymore */
+    closePipe(child->pipe_out);
+    closePipe(child->pipe_err);
+    child->pipe_out = child->pipe_err = -1;
+
+    child->retired = 1;
+    lib.retiredGroups++;
+}
+
+static void sweepRetired(void)
+{
+    if(!lib.retiredGroups) return;
+
+    struct childProcess* it = lib.firstProcess;
+    while(it) {
+        struct childProcess* next = it->next;
+        if(it->retired && !childAlive(it)) {
+            removeChild(it);
+        }
+        it = next;
+    }
+}
+
+/* Whether the current client may start another child as this user. A server only runs
+ * children of other users as themselves, they must name a user that matches. */
+static int admitChild(const char* userName, struct userCredentials* cred)
+{
+    struct slaveClient* client = lib.current;
+    if(!lib.server) return 1;
+
+    if(lib.maxChildren && client->children >= lib.maxChildren) return 0;
+    if(client->uid == 0 || client->uid == getuid()) return 1;
+
+    return strlen(userName) && cred && cred->uid == client->uid;
+}
+
+static void childReaped(struct childProcess* it, int status)
+{
+    it->status = status;
+    it->running = 0;
+    it->reaped = libChildNow();
+    lib.eventTime = it->reaped;
+    TRACE(&lib.trace, reap, LIBCHILD_TRACE_REAP, it->pid, status);
+    slotRelease(it);
+
+    /* The rest of the group may still be running, keep the deadline for it */
+    if(!it->pgid) {
+        timerCancel(&lib.timers, &it->timer);
+    }
+
+    if(WIFSIGNALED(status)) {
+        lib.stats.exitsBySignal++;
+    } else {
+        lib.stats.exitsNormal++;
+    }
+
+    notifyDead(&lib, it);
+}
+
+/* Descendants that lost their parent end up here because we are a subreaper.
+ * Their process group tells which job they came from. */
+static void orphanReaped(pid_t pid, pid_t pgid)
+{
+    lib.stats.orphansReaped++;
+
+    struct childProcess* owner = (pgid > 0) ? pidHashFind(pgid, 0) : NULL;
+    if(owner && owner->pgid == pgid) {
+        owner->orphansReaped++;
+        TRACE(&lib.trace, orphan_reap, LIBCHILD_TRACE_ORPHAN_REAP, pid, (uintptr_t)owner->echo);
+    } else {
+        TRACE(&lib.trace, orphan_reap, LIBCHILD_TRACE_ORPHAN_REAP, pid, 0);
+    }
+}
+
+static int stageReaped(struct childProcess* it, pid_t pid, int status)
+{
+    for(unsigned int i=0; i<it->stageCount; i++) {
+        struct pipelineStage* stage = &it->stages[i];
+        if(stage->pid == pid && stage->running) {
+            stage->running = 0;
+            stage->status = status;
+
+            /* Like a shell, the pipeline exits with the status of the last stage */
+            if(!--it->stagesRunning) {
+                childReaped(it, it->stages[it->stageCount - 1].status);
+            }
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void reapChildren(void)
+{
+    while(1) {
+        pid_t pid;
+        pid_t pgid = 0;
+        int status;
+
+        if(lib.groupLeaders) {
+            /* Peek first: the group of a zombie can still be read, after reaping it is gone */
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || !info.si_pid) {
+                break;
+            }
+
+            pid = info.si_pid;
+            if(!pidHashFind(pid, 1)) {
+                pgid = getpgid(pid);
+            }
+            if(waitpid(pid, &status, WNOHANG) <= 0) {
+                break;
+            }
+        } else {
+            pid = waitpid(-1, &status, WNOHANG);
+            if(pid <= 0) {
+                break;
+            }
+        }
+
+        /* Pipeline stages other than the first are only known by their process group */
+        struct childProcess* it = pidHashFind(pid, 1);
+        if(!it && pgid > 0) {
+            it = pidHashFind(pgid, 1);
+            if(it && !it->stages) {
+                it = NULL;
+            }
+        }
+
+        if(it && it->stages) {
+            if(!stageReaped(it, pid, status)) {
+                orphanReaped(pid, pgid);
+            }
+        } else if(it) {
+            childReaped(it, status);
+        } else {
+            orphanReaped(pid, pgid);
+        }
+    }
+
+    sweepRetired();
+}
+
+static void setCloExec(int fd)
+{
+    if(fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) slaveExit(&lib);
+}
+
+/* Output pipes are read until empty, and a client socket must never block us */
+static void setNonBlock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) slaveExit(&lib);
+}
+
+/* Descriptors the master passed for stdin, stdout and stderr, -1 where it did not */
+static void receiveStdio(struct rxBuffer* rx, unsigned int mask, int stdio[3])
+{
+    int received[3];
+    unsigned int count = 0;
+
+    for(unsigned int i=0; i<3; i++) {
+        stdio[i] = -1;
+        if(mask & (1 << i)) {
+            count++;
+        }
+    }
+
+    if(!count) return;
+    if(libChildReadFds(rx, received, count)) slaveExit(&lib);
+
+    count = 0;
+    for(unsigned int i=0; i<3; i++) {
+        if(mask & (1 << i)) {
+            stdio[i] = received[count++];
+        }
+    }
+}
+
+static struct filterState* receiveFilter(struct rxBuffer* rx, struct slaveExecOptions* options, struct arena* arena)
+{
+    if(!options->filter) return NULL;
+
+    struct slaveFilter settings;
+    if(libChildReadStruct(rx, &settings, sizeof(settings))) slaveExit(&lib);
+    char** patterns = libChildReadPack(rx, arena);
+    if(!patterns) slaveExit(&lib);
+
+    struct filterState* filter = filterCreate(patterns, &settings);
+    if(!filter) slaveExit(&lib);
+
+    return filter;
+}
+
+static void redirectStdio(int stdio[3])
+{
+    for(int i=0; i<3; i++) {
+        if(stdio[i] >= 0) {
+            dup2(stdio[i], i);
+        }
+    }
+}
+
+static void closeStdio(int stdio[3])
+{
+    for(int i=0; i<3; i++) {
+        closePipe(stdio[i]);
+    }
+}
+
+static int closeOnExecPipe(int fds[2])
+{
+    if(pipe(fds)) return -1;
+
+    setCloExec(fds[0]);
+    setCloExec(fds[1]);
+    return 0;
+}
+
+static void addChild(struct childProcess* child)
+{
+    child->next = lib.firstProcess;
+    child->prev = NULL;
+    if(child->next) {
+        child->next->prev = child;
+    }
+    lib.firstProcess = child;
+
+    idHashInsert(child);
+    child->client = lib.current;
+    if(child->client) {
+        child->client->children++;
+    }
+    lib.stats.children++;
+}
+
+/* In a forked child, before it runs anything */
+static void closeConnections(void)
+{
+    for(struct slaveClient* client = lib.clients; client; client = client->next) {
+        close(client->socket);
+    }
+    if(lib.listenFd >= 0) {
+        close(lib.listenFd);
+    }
+}
+
+static struct arena* takeArena(void)
+{
+    struct arena* arena = lib.freeArenas;
+    if(arena) {
+        lib.freeArenas = arena->next;
+        lib.freeArenaCount--;
+        return arena;
+    }
+
+    arena = (struct arena*)malloc(sizeof(struct arena));
+    if(!arena) slaveExit(&lib);
+    arenaInit(arena);
+    return arena;
+}
+
+/* Everything of the request comes from one arena, once warmed up decoding does not allocate */
+static struct execRequest* readRequest(struct rxBuffer* rx, struct slaveCommand* cmd)
+{
+    int pipeline = (cmd->command == SLAVE_COMMAND_EXEC_PIPELINE);
+    unsigned int count = pipeline ? (unsigned int)cmd->paramInteger >> 1 : 1;
+    if(!count || count > PIPELINE_MAX_STAGES) slaveExit(&lib);
+
+    struct arena* arena = takeArena();
+    size_t reqLen = sizeof(struct execRequest) + count * sizeof(struct execStage);
+    struct execRequest* req = (struct execRequest*)arenaAlloc(arena, reqLen);
+    if(!req) {
+        releaseArena(arena);
+        slaveExit(&lib);
+    }
+    memset(req, 0, reqLen);
+    req->arena = arena;
+    for(int i=0; i<3; i++) {
+        req->stdio[i] = -1;
+    }
+    /* Freed by slaveExit with its descriptors and filter if the client fails halfway */
+    lib.decoding = req;
+    req->pipeline = pipeline;
+    req->silent = pipeline ? !(cmd->paramInteger & 1) : (cmd->command == SLAVE_COMMAND_EXEC);
+    req->count = count;
+
+    /* Read parameters, a plain exec has its program first */
+    if(!pipeline) {
+        req->stages[0].program = libChildReadVariableArena(rx, arena);
+        if(!req->stages[0].program) slaveExit(&lib);
+    }
+    req->userName = libChildReadVariableArena(rx, arena);
+    if(!req->userName) slaveExit(&lib);
+    if(!pipeline) {
+        req->stages[0].argv = libChildReadPack(rx, arena);
+        if(!req->stages[0].argv) slaveExit(&lib);
+    }
+    req->env = libChildReadPack(rx, arena);
+    if(!req->env) slaveExit(&lib);
+    if(libChildReadStruct(rx, &req->options, sizeof(req->options))) slaveExit(&lib);
+    receiveStdio(rx, req->options.stdioFds, req->stdio);
+    req->filter = receiveFilter(rx, &req->options, arena);
+
+    if(pipeline) {
+        for(unsigned int i=0; i<count; i++) {
+            req->stages[i].program = libChildReadVariableArena(rx, arena);
+            if(!req->stages[i].program) slaveExit(&lib);
+            req->stages[i].argv = libChildReadPack(rx, arena);
+            if(!req->stages[i].argv) slaveExit(&lib);
+        }
+    }
+    lib.decoding = NULL;
+
+    /* Resolve the user here, the child should not have to talk to NSS */
+    if(strlen(req->userName)) {
+        req->cred = lookupUser(req->userName);
+    }
+
+    return req;
+}
+
+static void freeRequest(struct execRequest* req)
+{
+    closeStdio(req->stdio);
+    filterDestroy(req->filter);
+    /* The request itself lives in the arena */
+    releaseArena(req->arena);
+}
+
+/* Returns the pid, or -1 if the fork failed */
+static pid_t spawnExec(struct execRequest* req)
+{
+    struct childProcess* child = req->child;
+    int* stdio = req->stdio;
+
+    /* Redirected streams do not need a pipe */
+    int pipe_stdout[2] = {-1, -1}, pipe_stderr[2] = {-1, -1};
+    if(!req->silent) {
+        if((stdio[STDOUT_FILENO] < 0 && pipe(pipe_stdout)) ||
+           (stdio[STDERR_FILENO] < 0 && pipe(pipe_stderr))) {
+            /* Out of descriptors fails this child like a failed fork, not the worker */
+            closePipe(pipe_stdout[0]);
+            closePipe(pipe_stdout[1]);
+            return -1;
+        }
+    }
+
+    pid_t pid = fork();
+
+    if(!pid) {
+        if(strlen(req->userName)) {
+            if(!req->cred || applyUser(req->cred) != 1) {
+                /* Don't exec anything unless we dropped privileges */
+                _exit (EXIT_FAILURE);
+            }
+        }
+
+        /* Close the command sockets */
+        closeConnections();
+
+        if(req->options.flags & CHILD_EXEC_SESSION) {
+            setsid();
+        } else if(req->options.flags & CHILD_EXEC_PROCESS_GROUP) {
+            setpgid(0, 0);
+        }
+
+        /* Close all pipes except what we use */
+        closePipe(pipe_stdout[0]);
+        closePipe(pipe_stderr[0]);
+
+        /* Detach stdio */
+        detach(req->silent);
+
+        if(pipe_stdout[1] >= 0) {
+            dup2(pipe_stdout[1], STDOUT_FILENO);
+            close(pipe_stdout[1]);
+        }
+        if(pipe_stderr[1] >= 0) {
+            dup2(pipe_stderr[1], STDERR_FILENO);
+            close(pipe_stderr[1]);
+        }
+        redirectStdio(stdio);
+
+        /* Run */
+        execve(req->stages[0].program, req->stages[0].argv, req->env);
+        _exit (EXIT_FAILURE);
+
+    } else if(pid < 0) {
+        closePipe(pipe_stdout[0]);
+        closePipe(pipe_stderr[0]);
+
+    } else {
+        TRACE(&lib.trace, fork, LIBCHILD_TRACE_FORK, pid, (uintptr_t)child->echo);
+
+        if(req->options.flags & (CHILD_EXEC_SESSION | CHILD_EXEC_PROCESS_GROUP)) {
+            /* Also done here so a signal sent right away reaches the group, the
+             * child may have beaten us to it */
+            if(!(req->options.flags & CHILD_EXEC_SESSION)) {
+                setpgid(pid, pid);
+            }
+            child->pgid = pid;
+        }
+
+        if(pipe_stdout[0] >= 0) {
+            setCloExec(pipe_stdout[0]);
+            setNonBlock(pipe_stdout[0]);
+        }
+        if(pipe_stderr[0] >= 0) {
+            setCloExec(pipe_stderr[0]);
+            setNonBlock(pipe_stderr[0]);
+        }
+        child->pipe_out = pipe_stdout[0];
+        child->pipe_err = pipe_stderr[0];
+        lib.stats.spawns++;
+    }
+
+    /* Close write part of the pipe */
+    closePipe(pipe_stdout[1]);
+    closePipe(pipe_stderr[1]);
+
+    return pid;
+}
+
+/* Returns the process group, or -1 if not all stages could be started */
+static pid_t spawnPipeline(struct execRequest* req)
+{
+    struct childProcess* child = req->child;
+    unsigned int count = req->count;
+    int* stdio = req->stdio;
+
+    child->stages = (struct pipelineStage*)calloc(count, sizeof(struct pipelineStage));
+    if(!child->stages) return -1;
+    child->stageCount = count;
+
+    /* Everything is close-on-exec, the stages only keep what is dup'ed onto their stdio */
+    int pipe_stdout[2] = {-1, -1}, pipe_stderr[2] = {-1, -1};
+    if(!req->silent) {
+        if((stdio[STDOUT_FILENO] < 0 && closeOnExecPipe(pipe_stdout)) ||
+           (stdio[STDERR_FILENO] < 0 && closeOnExecPipe(pipe_stderr))) {
+            closePipe(pipe_stdout[0]);
+            closePipe(pipe_stdout[1]);
+            return -1;
+        }
+    }
+
+    pid_t pgid = 0;
+    int stdinFd = -1;
+    unsigned int started = 0;
+
+    for(; started<count; started++) {
+        int link[2] = {-1, -1};
+        int last = (started == count - 1);
+        if(!last && closeOnExecPipe(link)) {
+            break;
+        }
+
+        pid_t pid = fork();
+        if(!pid) {
+            if(strlen(req->userName)) {
+                if(!req->cred || applyUser(req->cred) != 1) {
+                    _exit (EXIT_FAILURE);
+                }
+            }
+
+            closeConnections();
+            setpgid(0, pgid);
+
+            detach(req->silent && last);
+
+            if(stdinFd >= 0) {
+                dup2(stdinFd, STDIN_FILENO);
+            } else if(stdio[STDIN_FILENO] >= 0) {
+                dup2(stdio[STDIN_FILENO], STDIN_FILENO);
+            }
+            if(!last) {
+                dup2(link[1], STDOUT_FILENO);
+            } else if(pipe_stdout[1] >= 0) {
+                dup2(pipe_stdout[1], STDOUT_FILENO);
+            } else if(stdio[STDOUT_FILENO] >= 0) {
+                dup2(stdio[STDOUT_FILENO], STDOUT_FILENO);
+            }
+            if(pipe_stderr[1] >= 0) {
+                dup2(pipe_stderr[1], STDERR_FILENO);
+            } else if(stdio[STDERR_FILENO] >= 0) {
+                dup2(stdio[STDERR_FILENO], STDERR_FILENO);
+            }
+
+            execve(req->stages[started].program, req->stages[started].argv, req->env);
+            _exit (EXIT_FAILURE);
+        }
+
+        if(pid < 0) {
+            if(!last) {
+                close(link[0]);
+                close(link[1]);
+            }
+            break;
+        }
+
+        if(!pgid) {
+            pgid = pid;
+        }
+        setpgid(pid, pgid);
+
+        child->stages[started].pid = pid;
+        child->stages[started].running = 1;
+        TRACE(&lib.trace, fork, LIBCHILD_TRACE_FORK, pid, (uintptr_t)child->echo);
+
+        if(stdinFd >= 0) {
+            close(stdinFd);
+        }
+        if(!last) {
+            close(link[1]);
+            stdinFd = link[0];
+        }
+    }
+
+    if(stdinFd >= 0) {
+        close(stdinFd);
+    }
+    closePipe(pipe_stdout[1]);
+    closePipe(pipe_stderr[1]);
+
+    if(started < count) {
+        /* All or nothing, the stages that did start would block on a missing neighbour */
+        if(pgid) {
+            kill(-pgid, SIGKILL);
+        }
+        for(unsigned int i=0; i<started; i++) {
+            while(waitpid(child->stages[i].pid, NULL, 0) < 0 && errno == EINTR) {}
+        }
+        closePipe(pipe_stdout[0]);
+        closePipe(pipe_stderr[0]);
+        return -1;
+    }
+
+    child->pgid = pgid;
+    child->stagesRunning = count;
+    child->pipe_out = pipe_stdout[0];
+    child->pipe_err = pipe_stderr[0];
+    if(child->pipe_out >= 0) {
+        setNonBlock(child->pipe_out);
+    }
+    if(child->pipe_err >= 0) {
+        setNonBlock(child->pipe_err);
+    }
+    lib.stats.spawns += count;
+
+    return pgid;
+}
+
+static void runCountAdd(int isTag, unsigned int key, int delta)
+{
+    struct runCount** link = &lib.runCounts;
+    while(*link && ((*link)->isTag != isTag || (*link)->key != key)) {
+        link = &(*link)->next;
+    }
+
+    if(!*link) {
+        *link = (struct runCount*)calloc(1, sizeof(struct runCount));
+        if(!*link) slaveExit(&lib);
+        (*link)->isTag = isTag;
+        (*link)->key = key;
+    }
+
+    struct runCount* count = *link;
+    count->running += delta;
+    if(!count->running) {
+        *link = count->next;
+        free(count);
+    }
+}
+
+static unsigned int runCountGet(int isTag, unsigned int key)
+{
+    for(struct runCount* it = lib.runCounts; it; it = it->next) {
+        if(it->isTag == isTag && it->key == key) {
+            return it->running;
+        }
+    }
+    return 0;
+}
+
+/* Whether the limits allow the child to start now, 0 means unlimited */
+static int slotFree(struct childProcess* child)
+{
+    struct slaveLimits* limits = &lib.limits;
+    if(limits->maxRunning && lib.runningJobs >= limits->maxRunning) return 0;
+    if(limits->maxPerUser && runCountGet(0, child->uid) >= limits->maxPerUser) return 0;
+    if(limits->maxPerTag && child->tag && runCountGet(1, child->tag) >= limits->maxPerTag) return 0;
+    return 1;
+}
+
+static void slotTake(struct childProcess* child)
+{
+    child->holdsSlot = 1;
+    lib.runningJobs++;
+    runCountAdd(0, child->uid, 1);
+    if(child->tag) {
+        runCountAdd(1, child->tag, 1);
+    }
+}
+
+static void slotRelease(struct childProcess* child)
+{
+    if(!child->holdsSlot) return;
+
+    child->holdsSlot = 0;
+    lib.runningJobs--;
+    runCountAdd(0, child->uid, -1);
+    if(child->tag) {
+        runCountAdd(1, child->tag, -1);
+    }
+    lib.slotsChanged = 1;
+}
+
+static void queueInsert(struct execRequest* req)
+{
+    /* Behind everything of the same or a higher priority */
+    struct execRequest* after = lib.queueLast;
+    while(after && after->options.priority < req->options.priority) {
+        after = after->prev;
+    }
+
+    req->prev = after;
+    req->next = after ? after->next : lib.queueFirst;
+    if(req->next) {
+        req->next->prev = req;
+    } else {
+        lib.queueLast = req;
+    }
+    if(after) {
+        after->next = req;
+    } else {
+        lib.queueFirst = req;
+    }
+    lib.stats.queued++;
+}
+
+static void queueRemove(struct execRequest* req)
+{
+    if(req->prev) {
+        req->prev->next = req->next;
+    } else {
+        lib.queueFirst = req->next;
+    }
+    if(req->next) {
+        req->next->prev = req->prev;
+    } else {
+        lib.queueLast = req->prev;
+    }
+    lib.stats.queued--;
+}
+
+/* Forks the request and tells the client, the request is freed */
+static void startRequest(struct execRequest* req)
+{
+    struct childProcess* child = req->child;
+    struct slaveClient* client = child->client;
+    child->request = NULL;
+
+    slotTake(child);
+    pid_t pid = req->pipeline ? spawnPipeline(req) : spawnExec(req);
+    lib.eventTime = libChildNow();
+
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = SLAVE_RESULT_CHILD_CREATED;
+    response.masterEcho = child->echo;
+
+    if(pid < 0) {
+        removeChild(child);
+        lib.stats.spawnFailures++;
+
+        response.paramChildProcess = NULL;
+        response.paramInteger = 0;
+    } else {
+        child->running = 1;
+        child->pid = pid;
+        pidHashInsert(child);
+        if(child->pgid) {
+            lib.groupLeaders++;
+        }
+
+        child->killSignal = req->options.killSignal;
+        child->killGraceMs = req->options.killGraceMs;
+        child->finalSignal = req->options.finalSignal;
+        if(req->options.deadlineMs) {
+            timerArm(&lib.timers, &child->timer, libChildNow() + req->options.deadlineMs * 1000000ULL);
+        }
+
+        response.paramChildProcess = child;
+        response.paramInteger = pid;
+    }
+
+    freeRequest(req);
+
+    if(sendResponse(client, &response)) {
+        slaveExit(&lib);
+    }
+}
+
+/* Starts what the limits allow in queue order. A request held back by the limit of its
+ * user or tag does not hold up the ones behind it. */
+static void startQueued(void)
+{
+    lib.slotsChanged = 0;
+
+    struct execRequest* req = lib.queueFirst;
+    while(req) {
+        if(lib.limits.maxRunning && lib.runningJobs >= lib.limits.maxRunning) break;
+
+        struct execRequest* next = req->next;
+        if(slotFree(req->child)) {
+            queueRemove(req);
+            startRequest(req);
+        }
+        req = next;
+    }
+}
+
+/* A request killed while queued never runs, it ends as if the signal had killed it */
+static void cancelRequest(struct childProcess* child, int sig)
+{
+    if(!sig) return;
+
+    struct execRequest* req = child->request;
+    queueRemove(req);
+    freeRequest(req);
+    child->request = NULL;
+
+    child->status = sig;
+    child->reaped = libChildNow();
+    lib.eventTime = child->reaped;
+    notifyDead(&lib, child);
+}
+
+/* Starts the request, or queues it while a limit is reached */
+static void submitRequest(struct execRequest* req, void* echo)
+{
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = SLAVE_RESULT_CHILD_CREATED;
+    response.masterEcho = echo;
+    response.paramChildProcess = NULL;
+    response.paramInteger = 0;
+
+    if(!admitChild(req->userName, req->cred)) {
+        freeRequest(req);
+        lib.stats.spawnFailures++;
+        if(sendResponse(lib.current, &response)) {
+            slaveExit(&lib);
+        }
+        return;
+    }
+
+    struct childProcess* child = (struct childProcess*)poolAlloc(&lib.processPool);
+    if(!child) slaveExit(&lib);
+
+    memset(child, 0, sizeof(*child));
+    child->pipe_out = -1;
+    child->pipe_err = -1;
+    child->silent = req->silent;
+    child->filter = req->filter;
+    req->filter = NULL;
+    child->tailBytes = req->options.tailBytes;
+    child->echo = echo;
+    child->uid = req->cred ? req->cred->uid : getuid();
+    child->tag = req->options.tag;
+    child->weight = req->options.outputWeight ? req->options.outputWeight : 1;
+    child->timer.index = 0;
+    child->timer.expired = childTimerExpired;
+    req->child = child;
+    addChild(child);
+
+    /* Whatever waits already goes first */
+    if(lib.slotsChanged) {
+        startQueued();
+    }
+
+    if(slotFree(child)) {
+        startRequest(req);
+        return;
+    }
+
+    child->request = req;
+    queueInsert(req);
+
+    response.result = SLAVE_RESULT_CHILD_QUEUED;
+    response.paramChildProcess = child;
+    if(sendResponse(lib.current, &response)) {
+        slaveExit(&lib);
+    }
+}
+
+/* Returns 0 or an errno value */
+static int startListening(const char* path, int backlog)
 {
-    struct childProcess* it = lib->firstProcess;
-    while(it) {
-        if(it->pipe_out >= 0) {
-            close(it->pipe_out);
-        }
-        if(it->pipe_err >= 0) {
-            close(it->pipe_err);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return errno;
+    setCloExec(fd);
+
+    /* Only our own user may take over the children. A server for several users needs
+     * the socket opened up, peers are told apart by their credentials. */
+    unlink(path);
+    mode_t oldMask = umask(0177);
+    int retVal = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(oldMask);
+    if(retVal || listen(fd, backlog)) {
+        retVal = errno;
+        close(fd);
+        return retVal;
+    }
+
+    if(lib.listenFd >= 0) {
+        close(lib.listenFd);
+        if(strcmp(lib.listenPath, path)) {
+            unlink(lib.listenPath);
         }
+    }
+    free(lib.listenPath);
+    lib.listenPath = strdup(path);
+    lib.listenFd = fd;
 
-        if(it->running) {
-            kill(it->pid, SIGKILL);
-            waitpid(it->pid, &it->status, 0);
+    return 0;
+}
 
-            /* Try to write something to the master, it may still be listening... */
-            struct slaveResponse response;
-            response.result = SLAVE_RESULT_CHILD_DIED;
-            response.paramChildProcess = it;
-            response.paramInteger = it->status;
-            response.masterEcho = it->echo;
+static void acceptClient(void)
+{
+    int fd = accept(lib.listenFd, NULL, NULL);
+    if(fd < 0) return;
+    setCloExec(fd);
 
-            libChildWriteFull(NULL, lib->socket, (char*)&response, sizeof(response));
-        }
-        struct childProcess* next = it->next;
-        free(it);
-        it = next;
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return;
     }
 
-    close(lib->socket);
-    _exit (EXIT_FAILURE);
+#ifdef __APPLE__
+    int set = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(set));
+#endif
+
+    struct slaveClient* client = (struct slaveClient*)calloc(1, sizeof(struct slaveClient));
+    if(!client) {
+        close(fd);
+        return;
+    }
+
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    int retVal = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen);
+    client->uid = cred.uid;
+#else
+    gid_t gid;
+    int retVal = getpeereid(fd, &client->uid, &gid);
+#endif
+    if(retVal) {
+        free(client);
+        close(fd);
+        return;
+    }
+
+    /* A detachable worker forwards nothing until it has adopted the children */
+    client->socket = fd;
+    client->bulkEpoch = 1;
+    client->next = lib.clients;
+    lib.clients = client;
+    lib.clientCount++;
 }
 
-static void detach(int silent)
+/* Statistics, tracing and adopting concern the whole worker, a server only allows them to its own user and root */
+static int clientPrivileged(struct slaveClient* client)
 {
-    umask(0);
-    int retVal = chdir("/");
-    (void)retVal;
+    return !lib.server || client->uid == 0 || client->uid == getuid();
+}
 
-    fclose(stdin);
-    fclose(stdout);
-    fclose(stderr);
+static void sendSnapshot(struct slaveResponse* response)
+{
+    /* Only what is waiting to be adopted, children of other clients are none of its business */
+    int visible = clientPrivileged(lib.current);
+    unsigned int count = 0;
+    FOREACH_CHILD(&lib, it) {
+        if(visible && !it->client && !it->retired) count++;
+    }
 
-    int fd = open("/dev/null", O_RDONLY);
-    dup2(fd, STDIN_FILENO);
-    close(fd);
+    struct slaveSnapshotEntry* entries = (struct slaveSnapshotEntry*)calloc(count ? count : 1, sizeof(struct slaveSnapshotEntry));
+    if(!entries) slaveExit(&lib);
 
-    if(silent) {
-        fd = open("/dev/null", O_RDWR);
-        dup2(fd, STDOUT_FILENO);
-        dup2(fd, STDERR_FILENO);
-        close(fd);
+    unsigned int i = 0;
+    FOREACH_CHILD(&lib, it) {
+        if(!visible || it->client || it->retired) continue;
+        entries[i].slaveId = it;
+        entries[i].pid = it->pid;
+        i++;
     }
+
+    response->result = SLAVE_RESULT_SNAPSHOT;
+    int failed = sendResponse(lib.current, response) ||
+                 clientWriteVariable(lib.current, entries, count * sizeof(struct slaveSnapshotEntry));
+    free(entries);
+    if(failed) slaveExit(&lib);
 }
 
-static void notifyDead(SlaveGlobal* lib, struct childProcess* it)
+static void adoptChildren(struct rxBuffer* rx)
 {
-    if(it->running) return;
-    if(!it->silent) {
-        if(it->pipe_out >= 0) return;
-        if(it->pipe_err >= 0) return;
+    unsigned int len;
+    struct slaveAdoptEntry* entries = (struct slaveAdoptEntry*)libChildReadVariable(rx, &len);
+    if(!entries) slaveExit(&lib);
+    if(!clientPrivileged(lib.current)) {
+        len = 0;
     }
 
-    struct slaveResponse response;
-    response.result = SLAVE_RESULT_CHILD_DIED;
-    response.paramChildProcess = it;
-    response.masterEcho = it->echo;
-    response.paramInteger = it->status;
+    for(unsigned int i=0; i<len / sizeof(struct slaveAdoptEntry); i++) {
+        struct childProcess* child = findChild(entries[i].slaveId, NULL);
+        if(!child) continue;
 
-    if(libChildWriteFull(NULL, lib->socket, (char*)&response, sizeof(response))) {
-        slaveExit(lib);
+        child->echo = entries[i].masterEcho;
+        child->client = lib.current;
+        child->bulkEpoch = 0;
+        lib.current->children++;
+
+        /* Whatever died in the meantime, or was never acknowledged by the old master */
+        notifyDead(&lib, child);
     }
+    free(entries);
 }
 
-#define FOREACH_CHILD(lib,it)   for(struct childProcess* it = (lib)->firstProcess; it; it = it->next)
+/* Walks a command in the receive buffer without consuming it, the same way it is decoded */
+struct commandScan {
+    struct rxBuffer* rx;
+    size_t len;
+};
 
-SlaveGlobal lib;
+#define SCAN(x) do { int scanResult = (x); if(scanResult) return scanResult; } while(0)
 
-static void signalHandler(int sig, siginfo_t *siginfo, void *context)
+/* Returns 0 if the next len bytes are there, 1 if not yet and -1 if the command gets too large */
+static int scanBytes(struct commandScan* scan, size_t len)
 {
-    int retVal = send(lib.chldFd[1], siginfo, sizeof(*siginfo), 0);
-    (void)retVal;
+    if(len > COMMAND_MAX_BYTES - scan->len) return -1;
+
+    scan->len += len;
+    return rxPeek(scan->rx, scan->len) ? 0 : 1;
 }
 
-static void pipeClosed(int fd)
+/* Copies the value into copy like libChildReadStruct when it is given */
+static int scanVariable(struct commandScan* scan, void* copy, unsigned int copyLen)
 {
-    FOREACH_CHILD(&lib, it) {
-        if(it->pipe_out == fd) {
-            close(it->pipe_out);
-            it->pipe_out = -1;
-            notifyDead(&lib, it);
-            break;
+    unsigned int len;
+    size_t at = scan->len;
+    SCAN(scanBytes(scan, sizeof(len)));
+    memcpy(&len, rxPeek(scan->rx, scan->len) + at, sizeof(len));
+    SCAN(scanBytes(scan, len));
+
+    if(copy) {
+        memset(copy, 0, copyLen);
+        memcpy(copy, rxPeek(scan->rx, scan->len) + at + sizeof(len), (len < copyLen) ? len : copyLen);
+    }
+    return 0;
+}
+
+static int scanPack(struct commandScan* scan)
+{
+    unsigned int values;
+    size_t at = scan->len;
+    SCAN(scanBytes(scan, sizeof(values)));
+    memcpy(&values, rxPeek(scan->rx, scan->len) + at, sizeof(values));
+
+    /* A large pack is only the marker byte of its memfd */
+    if(values & PACK_MEMFD_FLAG) return scanBytes(scan, 1);
+
+    for(unsigned int i=0; i<values; i++) {
+        SCAN(scanVariable(scan, NULL, 0));
+    }
+    return 0;
+}
+
+/* Follows readRequest */
+static int scanRequest(struct commandScan* scan, struct slaveCommand* cmd)
+{
+    int pipeline = (cmd->command == SLAVE_COMMAND_EXEC_PIPELINE);
+    unsigned int count = pipeline ? (unsigned int)cmd->paramInteger >> 1 : 1;
+    if(!count || count > PIPELINE_MAX_STAGES) return -1;
+
+    if(!pipeline) {
+        SCAN(scanVariable(scan, NULL, 0));
+    }
+    SCAN(scanVariable(scan, NULL, 0));
+    if(!pipeline) {
+        SCAN(scanPack(scan));
+    }
+    SCAN(scanPack(scan));
+
+    struct slaveExecOptions options;
+    SCAN(scanVariable(scan, &options, sizeof(options)));
+    if(options.stdioFds & 7) {
+        SCAN(scanBytes(scan, 1));
+    }
+    if(options.filter) {
+        SCAN(scanVariable(scan, NULL, 0));
+        SCAN(scanPack(scan));
+    }
+
+    if(pipeline) {
+        for(unsigned int i=0; i<count; i++) {
+            SCAN(scanVariable(scan, NULL, 0));
+            SCAN(scanPack(scan));
         }
-        if(it->pipe_err == fd) {
-            close(it->pipe_err);
-            it->pipe_err = -1;
-            notifyDead(&lib, it);
-            break;
+    }
+    return 0;
+}
+
+/* Returns 0 with the length of the command at the head of the receive buffer, 1 with the amount needed
+ * to make progress if it is not complete yet, or -1 if it cannot be a valid command */
+static int commandLength(struct rxBuffer* rx, size_t* len)
+{
+    struct commandScan scan;
+    scan.rx = rx;
+    scan.len = 0;
+
+    struct slaveCommand cmd;
+    int retVal = scanBytes(&scan, sizeof(cmd));
+    if(!retVal) {
+        memcpy(&cmd, rxPeek(rx, sizeof(cmd)), sizeof(cmd));
+
+        if(cmd.command == SLAVE_COMMAND_EXEC || cmd.command == SLAVE_COMMAND_EXEC_PIPE ||
+           cmd.command == SLAVE_COMMAND_EXEC_PIPELINE) {
+            retVal = scanRequest(&scan, &cmd);
+        } else if(cmd.command == SLAVE_COMMAND_TERMINATE_MANY) {
+            retVal = scanVariable(&scan, NULL, 0);
+            if(!retVal) {
+                retVal = scanVariable(&scan, NULL, 0);
+            }
+        } else if(cmd.command == SLAVE_COMMAND_TERMINATE || cmd.command == SLAVE_COMMAND_LISTEN ||
+                  cmd.command == SLAVE_COMMAND_ADOPT || cmd.command == SLAVE_COMMAND_SET_LIMITS) {
+            retVal = scanVariable(&scan, NULL, 0);
         }
     }
+
+    *len = scan.len;
+    return retVal;
 }
 
-static void setCloExec(int fd)
+static void handleCommand(struct rxBuffer* rx)
 {
-    if(fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) slaveExit(&lib);
+    struct slaveCommand cmd;
+    if(libChildReadFull(rx, (char*)&cmd, sizeof(cmd))) {
+        slaveExit(&lib);
+    }
+    lib.eventTime = libChildNow();
+
+    struct slaveResponse response;
+    memset(&response, 0, sizeof(response));
+    response.result = SLAVE_RESULT_NULL;
+    response.masterEcho = cmd.masterEcho;
+
+    if(cmd.command == SLAVE_COMMAND_EXEC || cmd.command == SLAVE_COMMAND_EXEC_PIPE ||
+       cmd.command == SLAVE_COMMAND_EXEC_PIPELINE) {
+        submitRequest(readRequest(rx, &cmd), cmd.masterEcho);
+
+    } else if (cmd.command == SLAVE_COMMAND_CLOSE_HANDLE) {
+        struct childProcess* child = findChild(cmd.paramChildProcess, lib.current);
+        if(child) {
+            TRACE(&lib.trace, close_handle, LIBCHILD_TRACE_CLOSE_HANDLE, child->pid, (uintptr_t)child->echo);
+            retireChild(child);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_KILL) {
+        struct childProcess* child = findChild(cmd.paramChildProcess, lib.current);
+        if(child && child->request) {
+            cancelRequest(child, cmd.paramInteger);
+        } else if(child && childAlive(child)) {
+            signalChild(child, cmd.paramInteger);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_TERMINATE) {
+        struct slaveTerminate terminate;
+        if(libChildReadStruct(rx, &terminate, sizeof(terminate))) slaveExit(&lib);
+
+        struct childProcess* child = findChild(cmd.paramChildProcess, lib.current);
+        if(child) {
+            terminateChild(child, &terminate);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_TERMINATE_MANY) {
+        struct slaveTerminate terminate;
+        if(libChildReadStruct(rx, &terminate, sizeof(terminate))) slaveExit(&lib);
+
+        unsigned int len;
+        struct childProcess** children = (struct childProcess**)libChildReadVariable(rx, &len);
+        if(!children) slaveExit(&lib);
+
+        if(cmd.paramInteger == SLAVE_TERMINATE_ALL) {
+            FOREACH_CHILD(&lib, child) {
+                if(child->client == lib.current) {
+                    terminateChild(child, &terminate);
+                }
+            }
+        } else {
+            for(unsigned int i=0; i<len / sizeof(struct childProcess*); i++) {
+                struct childProcess* child = findChild(children[i], lib.current);
+                if(child) {
+                    terminateChild(child, &terminate);
+                }
+            }
+        }
+        free(children);
+
+    } else if (cmd.command == SLAVE_COMMAND_FETCH_TAIL) {
+        struct childProcess* child = findChild(cmd.paramChildProcess, lib.current);
+        if(child && child->tailBytes) {
+            sendTail(&lib, child);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_LISTEN) {
+        char* path = libChildReadVariable(rx, NULL);
+        if(!path) slaveExit(&lib);
+
+        /* A server already listens, and must not hand its socket to one client */
+        response.result = SLAVE_RESULT_LISTENING;
+        response.paramInteger = lib.server ? EINVAL : startListening(path, 1);
+        free(path);
+        if(sendResponse(lib.current, &response)) {
+            slaveExit(&lib);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_ATTACH) {
+        sendSnapshot(&response);
+
+    } else if (cmd.command == SLAVE_COMMAND_ADOPT) {
+        adoptChildren(rx);
+
+    } else if (cmd.command == SLAVE_COMMAND_SET_LIMITS) {
+        struct slaveLimits limits;
+        if(libChildReadStruct(rx, &limits, sizeof(limits))) slaveExit(&lib);
+
+        /* A server has its limits from the command line, they are not one client's to change */
+        if(!lib.server) {
+            lib.limits = limits;
+            lib.slotsChanged = 1;
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_SET_SAMPLING) {
+        struct slaveClient* client = lib.current;
+        timerCancel(&lib.timers, &client->sampleTimer);
+        client->sampleMs = (cmd.paramInteger > 0) ? cmd.paramInteger : 0;
+
+#ifdef __linux__
+        /* Without /proc there is nothing to sample */
+        if(client->sampleMs && lib.procFd >= 0) {
+            client->sampleTimer.expired = sampleTimerExpired;
+            if(timerArm(&lib.timers, &client->sampleTimer, lib.eventTime + client->sampleMs * 1000000ULL)) slaveExit(&lib);
+        }
+#endif
+
+    } else if (cmd.command == SLAVE_COMMAND_QUIT) {
+        /* For a server that is only this client going away */
+        if(!lib.server) {
+            lib.quitting = 1;
+        }
+        slaveExit(&lib);
+
+    } else if (cmd.command == SLAVE_COMMAND_GET_STATS) {
+        lib.stats.processPool = lib.processPool.stats;
+
+        /* Count the answer itself too, a refused one is empty */
+        response.result = SLAVE_RESULT_STATS;
+        if(sendResponse(lib.current, &response)) {
+            slaveExit(&lib);
+        }
+        if(clientWriteVariable(lib.current, &lib.stats, clientPrivileged(lib.current) ? sizeof(lib.stats) : 0)) {
+            slaveExit(&lib);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_TRACE) {
+        /* Failing to allocate just leaves tracing off */
+        if(clientPrivileged(lib.current)) {
+            traceResize(&lib.trace, cmd.paramInteger);
+        }
+
+    } else if (cmd.command == SLAVE_COMMAND_TRACE_DUMP) {
+        unsigned int size = clientPrivileged(lib.current) ? traceSize(&lib.trace) : 0;
+        struct libChildTraceEvent* events = NULL;
+        if(size) {
+            events = (struct libChildTraceEvent*)malloc(size * sizeof(struct libChildTraceEvent));
+            if(events) {
+                traceCopy(&lib.trace, events);
+            } else {
+                size = 0;
+            }
+        }
+
+        response.result = SLAVE_RESULT_TRACE;
+        if(sendResponse(lib.current, &response)) {
+            slaveExit(&lib);
+        }
+        if(clientWriteVariable(lib.current, events, size * sizeof(struct libChildTraceEvent))) {
+            slaveExit(&lib);
+        }
+        free(events);
+    }
 }
 
-void libChildSlaveProcess(int socket)
+static void slaveSetup(void)
 {
     /* Disconnect standard IO */
     detach(1);
 
     lib.firstProcess = NULL;
-    lib.socket = socket;
+    poolInit(&lib.processPool, sizeof(struct childProcess), PROCESS_POOL_SLAB);
+    lib.trace.source = LIBCHILD_TRACE_WORKER;
 
     /* Become a session leader and create new process group */
     if(getpid() != 1){
         lib.grpId = setsid();
         if(lib.grpId < 0) {
-            slaveExit(&lib);
+            /* A server started as a group leader, by a service manager or a job control shell, keeps its group */
+            if(errno != EPERM || !lib.server) {
+                slaveExit(&lib);
+            }
+            lib.grpId = getpgrp();
         }
     }else{
         lib.grpId = 1;
     }
 
+#ifdef __linux__
+    /* Orphaned descendants of our children are reparented to us instead of init */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    lib.procFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    lib.clockTicks = sysconf(_SC_CLK_TCK);
+    lib.pageSize = sysconf(_SC_PAGESIZE);
+#else
+    lib.procFd = -1;
+#endif
+
     /* Create an socket to synchronize the signals */
     if(socketpair(AF_UNIX, SOCK_DGRAM, 0, lib.chldFd)){
         slaveExit(&lib);
@@ -214,36 +2442,88 @@ void libChildSlaveProcess(int socket)
         sigaction(i, &action, NULL);
     }
     signal(SIGPIPE, SIG_IGN);
+}
+
+static void slaveLoop(void)
+{
+    /* Losing a client we can do without comes back here */
+    setjmp(lib.dropped);
 
     while(1) {
-        int openPipes = 0;
+        /* Everything this iteration produced goes out as one write per client, each wakes up once for it */
+        struct slaveClient* client = lib.clients;
+        while(client) {
+            struct slaveClient* next = client->next;
+            clientFlush(client);
+            if(client->dead) {
+                if(lib.listenFd < 0) {
+                    slaveExit(&lib);
+                }
+                dropClient(&lib, client);
+            }
+            client = next;
+        }
 
+        /* Output stays in the pipes while nobody can take it */
+        int openPipes = 0;
         FOREACH_CHILD(&lib, it) {
+            if(!it->client || clientBacklogged(it->client)) continue;
             if(it->pipe_out >= 0) openPipes++;
             if(it->pipe_err >= 0) openPipes++;
         }
 
-        struct pollfd fds[2 + openPipes];
+        unsigned int numClients = lib.clientCount;
+        struct slaveClient* polled[numClients ? numClients : 1];
+        struct childProcess* owner[openPipes ? openPipes : 1];
+        struct pollfd fds[2 + numClients + openPipes];
         /* This FD signals when a child process died */
         const unsigned int SIGCHLD_FD = 0;
         fds[SIGCHLD_FD].fd = lib.chldFd[0];
         fds[SIGCHLD_FD].events = POLLIN;
 
-        /* This FD is used to receive commands from the parent */
-        const unsigned int CMD_FD = 1;
-        fds[CMD_FD].fd = lib.socket;
-        fds[CMD_FD].events = POLLIN;
+        /* New connections: a detachable worker waits for one master, a server while it has room */
+        const unsigned int LISTEN_FD = 1;
+        fds[LISTEN_FD].fd = -1;
+        if(lib.listenFd >= 0) {
+            if(lib.server ? (!lib.maxClients || numClients < lib.maxClients) : !numClients) {
+                fds[LISTEN_FD].fd = lib.listenFd;
+            }
+        }
+        fds[LISTEN_FD].events = POLLIN;
 
         int numPoll = 2;
 
+        /* These FDs are used to receive commands from the clients, and to send what they did not take yet.
+         * A client that has a command waiting already does not let us sleep. */
+        int commandWaiting = 0;
+        for(client = lib.clients; client; client = client->next) {
+            size_t len;
+            polled[numPoll - 2] = client;
+            fds[numPoll].fd = client->socket;
+            fds[numPoll].events = 0;
+            if(!clientBacklogged(client)) {
+                fds[numPoll].events |= POLLIN;
+                if(commandLength(&client->rx, &len) != 1) commandWaiting = 1;
+            }
+            if(client->unsentStart != client->unsent.len) {
+                fds[numPoll].events |= POLLOUT;
+            }
+            numPoll++;
+        }
+
+        const int firstPipe = numPoll;
         FOREACH_CHILD(&lib, it) {
+            if(!it->client || clientBacklogged(it->client)) continue;
+
             if(it->pipe_out >= 0) {
+                owner[numPoll - firstPipe] = it;
                 fds[numPoll].fd = it->pipe_out;
                 fds[numPoll].events = POLLIN;
                 numPoll++;
             }
 
             if(it->pipe_err >= 0) {
+                owner[numPoll - firstPipe] = it;
                 fds[numPoll].fd = it->pipe_err;
                 fds[numPoll].events = POLLIN;
                 numPoll++;
@@ -251,49 +2531,29 @@ void libChildSlaveProcess(int socket)
         }
 
         /* ppoll could be used as an alternative, but I find this code easier to follow */
-        int retVal = poll(fds, numPoll, -1);
-        if(retVal <= 0) {
+        int retVal = poll(fds, numPoll, commandWaiting ? 0 : timerTimeout(&lib.timers, libChildNow()));
+        if(retVal == 0 && !commandWaiting) {
+            timerRun(&lib.timers, libChildNow());
+            continue;
+        }
+        if(retVal < 0) {
             if(errno == EINTR) {
                 continue;
             }
             slaveExit(&lib);
         }
+        lib.stats.workerWakeups++;
+        timerRun(&lib.timers, libChildNow());
 
-        for(int i=2; i<numPoll; i++) {
-            if(fds[i].revents) {
-                if(fds[i].revents & POLLIN) {
-                    char buffer[512];
-                    ssize_t readLen = read(fds[i].fd, buffer, sizeof(buffer));
-                    if(readLen > 0) {
-                        FOREACH_CHILD(&lib, it) {
-                            if(it->pipe_out == fds[i].fd || it->pipe_err == fds[i].fd) {
-                                struct slaveResponse response;
-                                if(it->pipe_err == fds[i].fd) {
-                                    response.result = SLAVE_RESULT_CHILD_STDERR_DATA;
-                                } else {
-                                    response.result = SLAVE_RESULT_CHILD_STDOUT_DATA;
-                                }
-
-                                response.masterEcho = it->echo;
-
-                                if(libChildWriteFull(NULL, fds[CMD_FD].fd, (char*)&response, sizeof(response))) {
-                                    slaveExit(&lib);
-                                }
-
-                                if(libChildWriteVariable(NULL, fds[CMD_FD].fd, buffer, readLen)) {
-                                    slaveExit(&lib);
-                                }
-
-                                break;
-                            }
-                        }
-                    } else {
-                        pipeClosed(fds[i].fd);
-                    }
-                }
-                if(fds[i].revents & (POLLHUP | POLLERR)) {
-                    pipeClosed(fds[i].fd);
-                }
+        lib.round++;
+        for(int i=firstPipe; i<numPoll; i++) {
+            if(fds[i].revents & POLLIN) {
+                readOutput(owner[i - firstPipe], fds[i].fd);
+            }
+            /* With POLLIN there may still be data behind the hangup, the read returning 0 closes it */
+            else if(fds[i].revents & (POLLHUP | POLLERR)) {
+                lib.eventTime = libChildNow();
+                pipeClosed(fds[i].fd);
             }
         }
 
@@ -302,184 +2562,121 @@ void libChildSlaveProcess(int socket)
             if(recv(lib.chldFd[0], &sigInfo, sizeof(sigInfo), 0) != sizeof(sigInfo)) {
                 slaveExit(&lib);
             }
+            lib.eventTime = libChildNow();
 
             /* Is it SIGCHLD? */
             if(sigInfo.si_signo == SIGCHLD){
-                int status;
-                pid_t pid;
-
-                while((pid = waitpid(-lib.grpId, &status, WNOHANG)) > 0) {
-                    FOREACH_CHILD(&lib, it) {
-                        if(it->pid == pid && it->running) {
-                            it->status = status;
-                            it->running = 0;
-
-                            notifyDead(&lib, it);
-                            break;
-                        }
-                    }
-                }
+                reapChildren();
+            }else if(lib.server && (sigInfo.si_signo == SIGTERM || sigInfo.si_signo == SIGINT)){
+                /* Nobody to forward to, a server is stopped like a daemon */
+                lib.quitting = 1;
+                slaveExit(&lib);
             }else{
+                TRACE(&lib.trace, signal_forward, LIBCHILD_TRACE_SIGNAL_FORWARD, sigInfo.si_pid, sigInfo.si_signo);
+
+                /* Every client hears about it */
                 struct slaveResponse response;
+                memset(&response, 0, sizeof(response));
                 response.result = SLAVE_RESULT_GOT_SIGNAL;
-                if(libChildWriteFull(NULL, lib.socket, (char*)&response, sizeof(response))){
-                    slaveExit(&lib);
-                }
-                if(libChildWriteFull(NULL, lib.socket, (char*)&sigInfo, sizeof(sigInfo))){
-                    slaveExit(&lib);
-                }
-            }
-        }
-
-        if(fds[CMD_FD].revents & POLLIN) {
-            struct slaveCommand cmd;
-            if(libChildReadFull(fds[CMD_FD].fd, (char*)&cmd, sizeof(cmd), 0)) {
-                slaveExit(&lib);
-            }
-
-            struct slaveResponse response;
-            response.result = SLAVE_RESULT_NULL;
-            response.masterEcho = cmd.masterEcho;
-
-            if(cmd.command == SLAVE_COMMAND_EXEC || cmd.command == SLAVE_COMMAND_EXEC_PIPE) {
-                int silent = (cmd.command == SLAVE_COMMAND_EXEC);
-
-                /* Read parameters */
-                char* program = libChildReadVariable(fds[CMD_FD].fd, NULL);
-                if(!program) slaveExit(&lib);
-                char* userName = libChildReadVariable(fds[CMD_FD].fd, NULL);
-                if(!userName) slaveExit(&lib);
-                char** argv = libChildReadPack(fds[CMD_FD].fd);
-                if(!argv) slaveExit(&lib);
-                char** env = libChildReadPack(fds[CMD_FD].fd);
-                if(!env) slaveExit(&lib);
-
-                response.result = SLAVE_RESULT_CHILD_CREATED;
-
-                int pipe_stdout[2], pipe_stderr[2];
-                if(!silent) {
-                    if(pipe(pipe_stdout) || pipe(pipe_stderr)) {
+                for(client = lib.clients; client; client = client->next) {
+                    if(sendResponse(client, &response)){
                         slaveExit(&lib);
                     }
-                }
-
-                pid_t pid = fork();
-
-                if(!pid) {
-                    if(strlen(userName)) {
-                        if(changeUser(userName) != 1) {
-                            /* Don't exec anything unless we dropped privileges */
-                            _exit (EXIT_FAILURE);
-                        }
-                    }
-
-                    /* Close the command socket */
-                    close(lib.socket);
-
-                    /* Close all pipes except what we use */
-                    if(!silent) {
-                        close(pipe_stdout[0]);
-                        close(pipe_stderr[0]);
-                    }
-
-                    /* Detach stdio */
-                    detach(silent);
-
-                    if(!silent) {
-                        dup2(pipe_stdout[1], STDOUT_FILENO);
-                        dup2(pipe_stderr[1], STDERR_FILENO);
-                        close(pipe_stdout[1]);
-                        close(pipe_stderr[1]);
-                    }
-
-                    /* Run */
-                    execve(program, argv, env);
-                    _exit (EXIT_FAILURE);
-
-                } else if(pid < 0) {
-                    response.paramChildProcess = NULL;
-
-                    if(!silent) {
-                        close(pipe_stdout[0]);
-                        close(pipe_stderr[0]);
-                    }
-
-                } else {
-                    struct childProcess* child = (struct childProcess*)malloc(sizeof(struct childProcess));
-                    response.paramChildProcess = child;
-                    response.paramInteger = pid;
-
-                    child->running = 1;
-                    child->pid = pid;
-                    child->next = lib.firstProcess;
-                    child->silent = silent;
-
-                    if(silent) {
-                        child->pipe_out = -1;
-                        child->pipe_err = -1;
-                    } else {
-                        setCloExec(pipe_stdout[0]);
-                        setCloExec(pipe_stderr[0]);
-                        child->pipe_out = pipe_stdout[0];
-                        child->pipe_err = pipe_stderr[0];
-                    }
-
-                    if(child->next) {
-                        child->next->prev = child;
+                    if(clientWrite(client, &sigInfo, sizeof(sigInfo))){
+                        slaveExit(&lib);
                     }
-
-                    child->prev = NULL;
-                    child->echo = cmd.masterEcho;
-
-                    lib.firstProcess = child;
                 }
+            }
+        }
 
-                /* Close write part of the pipe */
-                if(!silent) {
-                    close(pipe_stdout[1]);
-                    close(pipe_stderr[1]);
-                }
+        /* One command per client and round, a busy client cannot starve the others */
+        for(unsigned int i=0; i<numClients; i++) {
+            client = polled[i];
+            if(client->dead) continue;
 
-                if(libChildWriteFull(NULL, fds[CMD_FD].fd, (char*)&response, sizeof(response))) {
+            /* A hangup shows up as a failing send if we were only waiting to write */
+            if(fds[2 + i].revents & (POLLOUT | POLLHUP | POLLERR)) {
+                clientDrain(client);
+            }
+            if(!(fds[2 + i].events & POLLIN)) continue;
+
+            /* Whatever is buffered is handled before a hangup is noticed */
+            lib.current = client;
+            size_t len;
+            int complete = commandLength(&client->rx, &len);
+            if(complete == 1 && (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                if(rxFill(&client->rx, client->socket, len) < 0) {
                     slaveExit(&lib);
                 }
+                complete = commandLength(&client->rx, &len);
+            }
+            if(complete < 0) {
+                slaveExit(&lib);
+            }
+            if(complete == 0) {
+                size_t end = client->rx.start + len;
+                handleCommand(&client->rx);
+                client->rx.start = end;
+            }
+            lib.current = NULL;
+        }
 
-                /* Free variable length things */
-                free(program);
-                libChildFreePack(argv);
-                libChildFreePack(env);
-
-            } else if (cmd.command == SLAVE_COMMAND_CLOSE_HANDLE) {
-                struct childProcess* child = (struct childProcess*)cmd.paramChildProcess;
-                if(child->prev) {
-                    child->prev->next = child->next;
-                } else {
-                    lib.firstProcess = child->next;
-                }
-                if(child->next) {
-                    child->next->prev = child->prev;
-                }
+        if(fds[LISTEN_FD].revents & POLLIN) {
+            acceptClient();
+        }
 
-                if(child->pipe_out >= 0) {
-                    close(child->pipe_out);
-                    child->pipe_out = -1;
-                }
-                if(child->pipe_err >= 0) {
-                    close(child->pipe_err);
-                    child->pipe_err = -1;
-                }
+        if(lib.slotsChanged) {
+            startQueued();
+        }
+    }
+}
 
-                free(child);
+void libChildSlaveProcess(int socket)
+{
+    lib.listenFd = -1;
+    slaveSetup();
+
+    /* The master that started us */
+    struct slaveClient* client = (struct slaveClient*)calloc(1, sizeof(struct slaveClient));
+    if(!client) slaveExit(&lib);
+    setNonBlock(socket);
+    client->socket = socket;
+    client->bulkEpoch = 1;
+    client->uid = getuid();
+    lib.clients = client;
+    lib.clientCount = 1;
+
+    slaveLoop();
+}
 
-            } else if (cmd.command == SLAVE_COMMAND_KILL) {
-                struct childProcess* child = (struct childProcess*)cmd.paramChildProcess;
-                if(child->running) {
-                    kill(child->pid, cmd.paramInteger);
-                }
+void libChildSlaveServer(const char* path, unsigned int maxClients, unsigned int maxChildren,
+                         const struct slaveLimits* limits)
+{
+    lib.server = 1;
+    lib.maxClients = maxClients;
+    lib.maxChildren = maxChildren;
+    lib.limits = *limits;
+
+    /* Before detaching: a relative path still means what the caller meant, and a failure can still be told */
+    lib.listenFd = -1;
+    int retVal = startListening(path, SOMAXCONN);
+    if(retVal) {
+        fprintf(stderr, "libchild-slave: cannot listen on %s: %s\n", path, strerror(retVal));
+        return;
+    }
 
-            } else if (cmd.command == SLAVE_COMMAND_QUIT) {
-                slaveExit(&lib);
-            }
+    /* It is removed again on exit, from another directory */
+    if(path[0] != '/') {
+        char* cwd = getcwd(NULL, 0);
+        char* absolute;
+        if(cwd && asprintf(&absolute, "%s/%s", cwd, path) >= 0) {
+            free(lib.listenPath);
+            lib.listenPath = absolute;
         }
+        free(cwd);
     }
+
+    slaveSetup();
+    slaveLoop();
 }
+
@@ -0,0 +1,88 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "def.h"
+
+static int parseNumber(const char* text, long* value)
+{
+    char* end;
+    *value = strtol(text, &end, 10);
+    return (!*text || *end || *value < 0) ? -1 : 0;
+}
+
+/* Standalone worker, see libChildCreateWorkerExec. The command socket is inherited, its
+ * number is the only argument.
+ *
+ * With --listen PATH [--max-clients N] [--max-children N] it is a server instead, shared by
+ * the masters that connect with libChildConnect. --max-running, --max-per-user and
+ * --max-per-tag set the limits of libChildSetLimits for all of them. 0 means no limit. */
+int main(int argc, char** argv)
+{
+    if(argc >= 3 && !strcmp(argv[1], "--listen")) {
+        long maxClients = 0, maxChildren = 0, maxRunning = 0, maxPerUser = 0, maxPerTag = 0;
+        for(int i=3; i<argc; i+=2) {
+            long* value;
+            if(!strcmp(argv[i], "--max-clients")) {
+                value = &maxClients;
+            } else if(!strcmp(argv[i], "--max-children")) {
+                value = &maxChildren;
+            } else if(!strcmp(argv[i], "--max-running")) {
+                value = &maxRunning;
+            } else if(!strcmp(argv[i], "--max-per-user")) {
+                value = &maxPerUser;
+            } else if(!strcmp(argv[i], "--max-per-tag")) {
+                value = &maxPerTag;
+            } else {
+                return EXIT_FAILURE;
+            }
+            if(i + 1 >= argc || parseNumber(argv[i + 1], value)) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        struct slaveLimits limits;
+        limits.maxRunning = maxRunning;
+        limits.maxPerUser = maxPerUser;
+        limits.maxPerTag = maxPerTag;
+
+        libChildSlaveServer(argv[2], maxClients, maxChildren, &limits);
+        return EXIT_FAILURE;
+    }
+
+    if(argc != 2) {
+        return EXIT_FAILURE;
+    }
+
+    long fd;
+    if(parseNumber(argv[1], &fd)) {
+        return EXIT_FAILURE;
+    }
+
+    libChildSlaveProcess(fd);
+    return EXIT_FAILURE;
+}
@@ -24,14 +24,19 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include "def.h"
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
 #ifdef __linux__
 #define SEND_FLAGS MSG_NOSIGNAL
@@ -39,109 +44,262 @@
 #define SEND_FLAGS 0
 #endif
 
-static void setNonBlock(int fd, int on){
-    int flags = fcntl(fd, F_GETFL, 0);
+/* Large packs travel as one sealed memfd where the kernel has them */
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define PACK_MEMFD
+#endif
+
+/* Commands are only decoded once all of one is in the receive buffer, running short means the peer sent garbage */
+int libChildReadFull(struct rxBuffer* rx, char* buffer, size_t len)
+{
+    char* data = rxPeek(rx, len);
+    if(!data) return -1;
+
+    memcpy(buffer, data, len);
+    rxConsume(rx, len);
+
+    return 0;
+}
+
+static int libChildQueue(struct LibChild* lib, char* buffer, size_t len)
+{
+    if(lib->txEnd + len > lib->txSize) {
+        size_t newSize = lib->txSize ? lib->txSize : 4096;
+        while(newSize < lib->txEnd + len) {
+            newSize *= 2;
+        }
 
-    if(on){
-        flags |=  O_NONBLOCK;
-    }else{
-        flags &=~ O_NONBLOCK;
+        char* newTx = realloc(lib->tx, newSize);
+        if(!newTx) return -1;
+
+        lib->tx = newTx;
+        lib->txSize = newSize;
     }
 
-    fcntl(fd, F_SETFL, flags);
+    memcpy(lib->tx + lib->txEnd, buffer, len);
+    lib->txEnd += len;
+
+    return 0;
 }
 
-int libChildReadFull(int fd, char* buffer, size_t len, int unblock)
+int libChildWriteFull(struct LibChild* lib, int fd, char* buffer, size_t len)
 {
-    int first = 1;
+    /* The master only queues, messages are sent as a whole by libChildFlush */
+    if(lib) {
+        return libChildQueue(lib, buffer, len);
+    }
 
     while(len) {
-        int doBlock = 0;
-        if(first && unblock){
-            setNonBlock(fd, 1);
-            doBlock = 1;
-        }
-        
-        ssize_t bytesRead = read(fd, buffer, len);
-
-        if(doBlock){
-            setNonBlock(fd, 0);
-        }
+        ssize_t bytesWritten = send(fd, buffer, len, SEND_FLAGS);
 
-        if(bytesRead < 0) {
+        if(bytesWritten < 0) {
             if(errno == EINTR) {
                 continue;
             }
-            if(errno == EAGAIN) {
-                return 1;
-            }
             return -1;
         }
-        if(bytesRead == 0){
+        if(bytesWritten == 0) {
             return -1;
         }
-        len -= bytesRead;
-        buffer += bytesRead;
-        first = 0;
+        len -= bytesWritten;
+        buffer += bytesWritten;
     }
 
     return 0;
 }
 
-int libChildWriteFull(struct LibChild* lib, int fd, char* buffer, size_t len)
+/* Sends the marker byte at txStart together with its file descriptors */
+static ssize_t sendAttachment(struct LibChild* lib, struct txAttachment* attach)
 {
-    while(len) {
-        if(lib){
-            setNonBlock(fd, 1);
+    char control[CMSG_SPACE(sizeof(attach->fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = lib->tx + lib->txStart;
+    iov.iov_len = 1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(attach->count * sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(attach->count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), attach->fds, attach->count * sizeof(int));
+
+    ssize_t bytesWritten = sendmsg(lib->sockets[0], &msg, SEND_FLAGS | MSG_DONTWAIT);
+    if(bytesWritten > 0) {
+        /* The worker has its own copy now */
+        for(unsigned int i=0; i<attach->count; i++) {
+            close(attach->fds[i]);
         }
-        ssize_t bytesWritten = send(fd, buffer, len, SEND_FLAGS);
-        if(lib){
-            setNonBlock(fd, 0);
+        lib->txAttachSent++;
+    }
+
+    return bytesWritten;
+}
+
+int libChildFlush(struct LibChild* lib)
+{
+    int fd = lib->sockets[0];
+
+    /* Indices are reread every iteration, a nested flush may have sent (part of) the queue already */
+    while(lib->txStart < lib->txEnd) {
+        struct txAttachment* attach = NULL;
+        size_t end = lib->txEnd;
+        if(lib->txAttachSent < lib->txAttachCount) {
+            attach = &lib->txAttach[lib->txAttachSent];
+            end = attach->offset;
+        }
+
+        /* Plain data stops at the next marker byte, so the descriptors arrive with exactly that byte */
+        ssize_t bytesWritten;
+        if(attach && lib->txStart == end) {
+            bytesWritten = sendAttachment(lib, attach);
+        } else {
+            bytesWritten = send(fd, lib->tx + lib->txStart, end - lib->txStart, SEND_FLAGS | MSG_DONTWAIT);
         }
 
         if(bytesWritten < 0) {
             if(errno == EINTR) {
                 continue;
             }
-            if(errno == EAGAIN) {
-                /* We cannot write, so the buffer is likely full. This function will try to read. 
-                 * In principle the call stack can grow unbounded here, if the poll causes new things to be written.
-                 * This should not happen in practice */
-                if(!libChildPoll(lib)){
-                    continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                lib->stats.writeStalls++;
+
+                /* We cannot write, so the buffer is likely full. Read what the worker sent us, it may be
+                 * blocked on us. Callbacks may queue new messages, these go after the ones already queued. */
+                if(libChildPoll(lib)) {
+                    return -1;
                 }
+
+                struct pollfd fds[1];
+                fds[0].fd = fd;
+                fds[0].events = POLLIN | POLLOUT;
+                poll(fds, 1, -1);
+                continue;
             }
             return -1;
         }
         if(bytesWritten == 0) {
             return -1;
         }
-        len -= bytesWritten;
-        buffer += bytesWritten;
+        lib->txStart += bytesWritten;
+    }
+
+    lib->txStart = 0;
+    lib->txEnd = 0;
+    lib->txAttachCount = 0;
+    lib->txAttachSent = 0;
+
+    return 0;
+}
+
+/* Queues a marker byte that carries duplicates of the given descriptors */
+int libChildQueueFds(struct LibChild* lib, int* fds, unsigned int count)
+{
+    if(count > sizeof(((struct txAttachment*)0)->fds) / sizeof(int)) return -1;
+
+    if(lib->txAttachCount == lib->txAttachSize) {
+        unsigned int newSize = lib->txAttachSize ? lib->txAttachSize * 2 : 4;
+        struct txAttachment* newAttach = realloc(lib->txAttach, newSize * sizeof(struct txAttachment));
+        if(!newAttach) return -1;
+
+        lib->txAttach = newAttach;
+        lib->txAttachSize = newSize;
+    }
+
+    struct txAttachment* attach = &lib->txAttach[lib->txAttachCount];
+    attach->offset = lib->txEnd;
+    attach->count = 0;
+
+    for(unsigned int i=0; i<count; i++) {
+        int dupFd = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if(dupFd < 0) goto fail;
+        attach->fds[attach->count++] = dupFd;
     }
 
+    char marker = 0;
+    if(libChildQueue(lib, &marker, sizeof(marker))) goto fail;
+
+    lib->txAttachCount++;
     return 0;
+
+fail:
+    for(unsigned int i=0; i<attach->count; i++) {
+        close(attach->fds[i]);
+    }
+    return -1;
+}
+
+/* Drops everything queued after mark, including descriptors */
+void libChildTxRollback(struct LibChild* lib, size_t mark)
+{
+    /* What a failed flush sent already cannot be taken back */
+    if(mark < lib->txStart) {
+        mark = lib->txStart;
+    }
+
+    while(lib->txAttachCount > lib->txAttachSent && lib->txAttach[lib->txAttachCount - 1].offset >= mark) {
+        struct txAttachment* attach = &lib->txAttach[--lib->txAttachCount];
+        for(unsigned int i=0; i<attach->count; i++) {
+            close(attach->fds[i]);
+        }
+    }
+
+    lib->txEnd = mark;
+}
+
+/* Closes descriptors that were queued but never sent */
+void libChildDropFds(struct LibChild* lib)
+{
+    for(unsigned int i=lib->txAttachSent; i<lib->txAttachCount; i++) {
+        for(unsigned int j=0; j<lib->txAttach[i].count; j++) {
+            close(lib->txAttach[i].fds[j]);
+        }
+    }
+
+    free(lib->txAttach);
+    lib->txAttach = NULL;
+    lib->txAttachCount = 0;
+    lib->txAttachSent = 0;
+    lib->txAttachSize = 0;
+}
+
+/* Reads the marker byte queued by libChildQueueFds, the descriptors came with it and are close-on-exec */
+int libChildReadFds(struct rxBuffer* rx, int* fds, unsigned int count)
+{
+    char marker;
+    if(libChildReadFull(rx, &marker, sizeof(marker))) return -1;
+
+    return rxTakeFds(rx, fds, count);
 }
 
 int libChildWriteVariable(struct LibChild* lib, int fd, void* buf, unsigned int len)
 {
+    if(len > COMMAND_MAX_BYTES) return -1;
     if(libChildWriteFull(lib, fd, (char*)&len, sizeof(len))) return -1;
     if(libChildWriteFull(lib, fd, buf, len)) return -1;
 
     return 0;
 }
 
-char* libChildReadVariable(int fd, unsigned int* readLen)
+char* libChildReadVariable(struct rxBuffer* rx, unsigned int* readLen)
 {
     if(readLen) *readLen = 0;
 
     unsigned int len;
-    if(libChildReadFull(fd, (char*)&len, sizeof(len), 0)) return NULL;
+    if(libChildReadFull(rx, (char*)&len, sizeof(len))) return NULL;
+    if(len > COMMAND_MAX_BYTES) return NULL;
 
-    char* buf = malloc(len+1);
+    char* buf = malloc((size_t)len + 1);
     if(!buf) return buf;
 
-    if(libChildReadFull(fd, buf, len, 0)) {
+    if(libChildReadFull(rx, buf, len)) {
         free(buf);
         return NULL;
     }
@@ -153,15 +311,98 @@ char* libChildReadVariable(int fd, unsigned int* readLen)
     return buf;
 }
 
+/* Like libChildReadVariable, the string is allocated from the arena */
+char* libChildReadVariableArena(struct rxBuffer* rx, struct arena* arena)
+{
+    unsigned int len;
+    if(libChildReadFull(rx, (char*)&len, sizeof(len))) return NULL;
+    if(len > COMMAND_MAX_BYTES) return NULL;
+
+    char* buf = (char*)arenaAlloc(arena, (size_t)len + 1);
+    if(!buf) return NULL;
+
+    if(libChildReadFull(rx, buf, len)) return NULL;
+    buf[len] = 0;
+
+    return buf;
+}
+
+/* Reads a variable into a fixed structure. Missing fields are zeroed and extra ones skipped,
+ * so both sides can add fields at the end. */
+int libChildReadStruct(struct rxBuffer* rx, void* buf, unsigned int len)
+{
+    unsigned int sentLen;
+    if(libChildReadFull(rx, (char*)&sentLen, sizeof(sentLen))) return -1;
+    if(sentLen > COMMAND_MAX_BYTES) return -1;
+
+    memset(buf, 0, len);
+    if(libChildReadFull(rx, buf, (sentLen < len) ? sentLen : len)) return -1;
+
+    if(sentLen > len) {
+        if(!rxPeek(rx, sentLen - len)) return -1;
+        rxConsume(rx, sentLen - len);
+    }
+
+    return 0;
+}
+
+#ifdef PACK_MEMFD
+/* Writes the values NUL terminated into a sealed memfd and queues it after the value count.
+ * Returns 1 if no memfd could be made, the caller then sends the pack inline. */
+static int writePackMemfd(struct LibChild* lib, int fd, char** arg, unsigned int values, size_t bytes)
+{
+    int memFd = memfd_create("libchild-pack", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(memFd < 0) return 1;
+
+    int result = 1;
+    if(ftruncate(memFd, bytes)) goto out;
+
+    char* map = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, memFd, 0);
+    if(map == MAP_FAILED) goto out;
+
+    char* pos = map;
+    for(unsigned int i=0; i<values; i++) {
+        pos = stpcpy(pos, arg[i]) + 1;
+    }
+    munmap(map, bytes);
+
+    /* The worker maps it, so it must not change size or contents after this */
+    if(fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) goto out;
+
+    result = -1;
+    unsigned int header = values | PACK_MEMFD_FLAG;
+    if(libChildWriteFull(lib, fd, (char*)&header, sizeof(header))) goto out;
+    if(libChildQueueFds(lib, &memFd, 1)) goto out;
+    result = 0;
+
+out:
+    /* libChildQueueFds keeps its own duplicate */
+    close(memFd);
+    return result;
+}
+#endif
+
 int libChildWritePack(struct LibChild* lib, int fd, char** arg)
 {
     unsigned int values = 0;
+    size_t bytes = 0;
     /* Search for null */
     if(arg) {
         while(arg[values]) {
+            bytes += strlen(arg[values]) + 1;
             values++;
         }
     }
+    if(values & PACK_MEMFD_FLAG) return -1;
+    if(bytes > COMMAND_MAX_BYTES) return -1;
+
+#ifdef PACK_MEMFD
+    /* Only the master queues descriptors */
+    if(lib && bytes >= PACK_MEMFD_BYTES) {
+        int result = writePackMemfd(lib, fd, arg, values, bytes);
+        if(result <= 0) return result;
+    }
+#endif
 
     if(libChildWriteFull(lib, fd, (char*)&values, sizeof(values))) return -1;
 
@@ -172,40 +413,81 @@ int libChildWritePack(struct LibChild* lib, int fd, char** arg)
     return 0;
 }
 
-void libChildFreePack(char** arg)
+#ifdef PACK_MEMFD
+/* Builds the pointers in place over the memfd that follows the value count */
+static char** readPackMemfd(struct rxBuffer* rx, unsigned int values, struct arena* arena)
 {
-    if(!arg) return;
+    int memFd;
+    if(libChildReadFds(rx, &memFd, 1)) return NULL;
 
-    unsigned int values = 0;
-    while(arg[values]) {
-        free(arg[values]);
-        arg[values] = NULL;
-        values ++;
+    char** arg = NULL;
+    char* map = MAP_FAILED;
+    size_t len = 0;
+
+    /* Unsealed, the sender could still truncate it under our mapping */
+    int seals = fcntl(memFd, F_GET_SEALS);
+    if(seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) goto fail;
+
+    struct stat st;
+    if(fstat(memFd, &st) || st.st_size <= 0 || st.st_size > COMMAND_MAX_BYTES) goto fail;
+    len = st.st_size;
+
+    /* Every value takes at least its NUL */
+    if(values > len) goto fail;
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, memFd, 0);
+    if(map == MAP_FAILED) goto fail;
+    if(map[len - 1]) goto fail;
+    if(arenaAddMap(arena, map, len)) goto fail;
+    close(memFd);
+
+    arg = (char**)arenaAlloc(arena, ((size_t)values + 1) * sizeof(char*));
+    if(!arg) return NULL;
+
+    char* pos = map;
+    for(unsigned int i=0; i<values; i++) {
+        if(pos >= map + len) return NULL;
+        arg[i] = pos;
+        pos += strlen(pos) + 1;
     }
+    if(pos != map + len) return NULL;
 
-    free(arg);
+    arg[values] = NULL;
+    return arg;
+
+fail:
+    if(map != MAP_FAILED) {
+        munmap(map, len);
+    }
+    close(memFd);
+    return NULL;
 }
+#endif
 
-char** libChildReadPack(int fd)
+/* The pack lives in the arena, a large one is mapped and unmapped when the arena is reset */
+char** libChildReadPack(struct rxBuffer* rx, struct arena* arena)
 {
     unsigned int values;
-    if(libChildReadFull(fd, (char*)&values, sizeof(values), 0)) return NULL;
+    if(libChildReadFull(rx, (char*)&values, sizeof(values))) return NULL;
 
-    unsigned int alen = (values + 1) * sizeof(char*);
-
-    char** arg = (char**)malloc(alen);
-    if(!arg) return arg;
+    if(values & PACK_MEMFD_FLAG) {
+#ifdef PACK_MEMFD
+        return readPackMemfd(rx, values & ~PACK_MEMFD_FLAG, arena);
+#else
+        return NULL;
+#endif
+    }
+    /* Every value takes at least its length */
+    if(values > COMMAND_MAX_BYTES / sizeof(unsigned int)) return NULL;
 
-    memset(arg, 0, alen);
+    char** arg = (char**)arenaAlloc(arena, ((size_t)values + 1) * sizeof(char*));
+    if(!arg) return NULL;
 
     for(unsigned int i=0; i<values; i++) {
-        arg[i] = libChildReadVariable(fd, NULL);
-        if(!arg[i]) {
-            libChildFreePack(arg);
-            return NULL;
-        }
+        arg[i] = libChildReadVariableArena(rx, arena);
+        if(!arg[i]) return NULL;
     }
+    arg[values] = NULL;
 
     return arg;
 }
-
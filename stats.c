@@ -0,0 +1,105 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include "def.h"
+
+/* Log-linear buckets: values below 2^HISTOGRAM_SUB_BITS get their own bucket, every power of two
+ * above that is split in 2^HISTOGRAM_SUB_BITS linear sub-buckets */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB      (1 << HISTOGRAM_SUB_BITS)
+
+uint64_t libChildNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int histogramIndex(uint64_t value)
+{
+    if(value < HISTOGRAM_SUB) {
+        return value;
+    }
+
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int index = ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+                         ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+
+    if(index >= LIBCHILD_HISTOGRAM_BUCKETS) {
+        index = LIBCHILD_HISTOGRAM_BUCKETS - 1;
+    }
+
+    return index;
+}
+
+/* Highest value that ends up in the given bucket */
+static uint64_t histogramValue(unsigned int index)
+{
+    if(index < HISTOGRAM_SUB) {
+        return index;
+    }
+
+    unsigned int msb = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index & (HISTOGRAM_SUB - 1);
+
+    return ((HISTOGRAM_SUB + sub + 1) << (msb - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void histogramRecord(struct libChildHistogram* histogram, uint64_t value)
+{
+    histogram->count++;
+    histogram->sum += value;
+    if(value > histogram->max) {
+        histogram->max = value;
+    }
+
+    histogram->buckets[histogramIndex(value)]++;
+}
+
+unsigned long long libChildHistogramPercentile(const struct libChildHistogram* histogram, double percentile)
+{
+    if(!histogram->count) {
+        return 0;
+    }
+
+    unsigned long long wanted = (unsigned long long)(percentile / 100.0 * histogram->count + 0.5);
+    if(wanted < 1) {
+        wanted = 1;
+    }
+
+    unsigned long long seen = 0;
+    for(unsigned int i = 0; i < LIBCHILD_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if(seen >= wanted) {
+            uint64_t value = histogramValue(i);
+            return (value < histogram->max) ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,144 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include "def.h"
+
+/* Binary min-heap on the expiry time. Entries remember their slot (plus one, zero means not armed)
+ * so they can be cancelled or moved without searching. */
+
+static void timerSwap(struct timerHeap* heap, unsigned int a, unsigned int b)
+{
+    struct timerEntry* tmp = heap->entries[a];
+    heap->entries[a] = heap->entries[b];
+    heap->entries[b] = tmp;
+
+    heap->entries[a]->index = a + 1;
+    heap->entries[b]->index = b + 1;
+}
+
+static void timerUp(struct timerHeap* heap, unsigned int i)
+{
+    while(i > 0) {
+        unsigned int parent = (i - 1) / 2;
+        if(heap->entries[parent]->expires <= heap->entries[i]->expires) {
+            break;
+        }
+        timerSwap(heap, parent, i);
+        i = parent;
+    }
+}
+
+static void timerDown(struct timerHeap* heap, unsigned int i)
+{
+    while(1) {
+        unsigned int smallest = i;
+        unsigned int left = 2 * i + 1;
+        unsigned int right = 2 * i + 2;
+
+        if(left < heap->count && heap->entries[left]->expires < heap->entries[smallest]->expires) {
+            smallest = left;
+        }
+        if(right < heap->count && heap->entries[right]->expires < heap->entries[smallest]->expires) {
+            smallest = right;
+        }
+        if(smallest == i) {
+            break;
+        }
+        timerSwap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+void timerCancel(struct timerHeap* heap, struct timerEntry* entry)
+{
+    if(!entry->index) {
+        return;
+    }
+
+    unsigned int i = entry->index - 1;
+    entry->index = 0;
+
+    heap->count--;
+    if(i == heap->count) {
+        return;
+    }
+
+    heap->entries[i] = heap->entries[heap->count];
+    heap->entries[i]->index = i + 1;
+    timerUp(heap, i);
+    timerDown(heap, i);
+}
+
+int timerArm(struct timerHeap* heap, struct timerEntry* entry, uint64_t expires)
+{
+    timerCancel(heap, entry);
+
+    if(heap->count == heap->size) {
+        unsigned int newSize = heap->size ? heap->size * 2 : 64;
+        struct timerEntry** newEntries = realloc(heap->entries, newSize * sizeof(struct timerEntry*));
+        if(!newEntries) return -1;
+
+        heap->entries = newEntries;
+        heap->size = newSize;
+    }
+
+    entry->expires = expires;
+    entry->index = heap->count + 1;
+    heap->entries[heap->count++] = entry;
+    timerUp(heap, heap->count - 1);
+
+    return 0;
+}
+
+int timerTimeout(struct timerHeap* heap, uint64_t now)
+{
+    if(!heap->count) {
+        return -1;
+    }
+
+    uint64_t expires = heap->entries[0]->expires;
+    if(expires <= now) {
+        return 0;
+    }
+
+    /* Round up, waking up early only costs another loop */
+    uint64_t ms = (expires - now + 999999) / 1000000;
+    if(ms > 60000) {
+        ms = 60000;
+    }
+
+    return ms;
+}
+
+void timerRun(struct timerHeap* heap, uint64_t now)
+{
+    while(heap->count && heap->entries[0]->expires <= now) {
+        struct timerEntry* entry = heap->entries[0];
+        timerCancel(heap, entry);
+        entry->expired(entry);
+    }
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "def.h"
+#include "trace.h"
+
+void traceRecord(struct traceRing* ring, unsigned int type, int pid, uint64_t arg)
+{
+    struct libChildTraceEvent* event = &ring->events[ring->head & ring->mask];
+    event->timestamp = libChildNow();
+    event->arg = arg;
+    event->pid = pid;
+    event->type = type;
+    event->source = ring->source;
+
+    ring->head++;
+}
+
+int traceResize(struct traceRing* ring, unsigned int entries)
+{
+    free(ring->events);
+    ring->events = NULL;
+    ring->mask = 0;
+    ring->head = 0;
+
+    if(!entries) {
+        return 0;
+    }
+    if(entries > TRACE_MAX_ENTRIES) {
+        entries = TRACE_MAX_ENTRIES;
+    }
+
+    /* Power of two, so the index is a mask */
+    unsigned int size = 1;
+    while(size < entries) {
+        size <<= 1;
+    }
+
+    ring->events = (struct libChildTraceEvent*)calloc(size, sizeof(struct libChildTraceEvent));
+    if(!ring->events) {
+        return -1;
+    }
+    ring->mask = size - 1;
+
+    return 0;
+}
+
+unsigned int traceSize(struct traceRing* ring)
+{
+    if(!ring->events) {
+        return 0;
+    }
+
+    if(ring->head > ring->mask) {
+        return ring->mask + 1;
+    }
+
+    return ring->head;
+}
+
+/* Copies the recorded events oldest first */
+void traceCopy(struct traceRing* ring, struct libChildTraceEvent* out)
+{
+    unsigned int size = traceSize(ring);
+    uint64_t first = ring->head - size;
+
+    for(unsigned int i = 0; i < size; i++) {
+        out[i] = ring->events[(first + i) & ring->mask];
+    }
+}
+
+int traceWrite(struct traceRing* ring, int fd)
+{
+    unsigned int size = traceSize(ring);
+    if(!size) {
+        return 0;
+    }
+
+    struct libChildTraceEvent* events = (struct libChildTraceEvent*)malloc(size * sizeof(struct libChildTraceEvent));
+    if(!events) {
+        return -1;
+    }
+    traceCopy(ring, events);
+
+    char* buffer = (char*)events;
+    size_t len = size * sizeof(struct libChildTraceEvent);
+    while(len) {
+        ssize_t bytesWritten = write(fd, buffer, len);
+        if(bytesWritten < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            free(events);
+            return -1;
+        }
+        len -= bytesWritten;
+        buffer += bytesWritten;
+    }
+
+    free(events);
+    return 0;
+}
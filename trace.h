@@ -0,0 +1,71 @@
+/* Copyright (c) 2018, Bertold Van den Bergh
+ * All rights reserved.
+ *
+ * #Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBCHILD_TRACE_H_
+#define LIBCHILD_TRACE_H_
+
+#include <stdint.h>
+#include "libchild.h"
+
+/* Static tracepoints, only if systemtap's header is around. They compile to a nop. */
+#if defined(__has_include) && !defined(LIBCHILD_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LIBCHILD_HAVE_SDT
+#endif
+#endif
+
+#ifdef LIBCHILD_HAVE_SDT
+#define TRACE_PROBE(probe, pid, arg) DTRACE_PROBE2(libchild, probe, pid, arg)
+#else
+#define TRACE_PROBE(probe, pid, arg) do {} while(0)
+#endif
+
+struct traceRing {
+    struct libChildTraceEvent* events;
+    unsigned int mask;
+    uint64_t head;
+    int source;
+};
+
+/* Fires the tracepoint and, when the ring is enabled, records the event */
+#define TRACE(ring, probe, type, pid, arg) do {                         \
+        TRACE_PROBE(probe, pid, arg);                                   \
+        if(__builtin_expect((ring)->events != NULL, 0)) {               \
+            traceRecord((ring), (type), (pid), (arg));                  \
+        }                                                               \
+    } while(0)
+
+/* Larger requests are clamped, the ring has to fit in one frame */
+#define TRACE_MAX_ENTRIES (1u << 20)
+
+void traceRecord(struct traceRing* ring, unsigned int type, int pid, uint64_t arg);
+int  traceResize(struct traceRing* ring, unsigned int entries);
+int  traceWrite(struct traceRing* ring, int fd);
+unsigned int traceSize(struct traceRing* ring);
+void traceCopy(struct traceRing* ring, struct libChildTraceEvent* out);
+
+#endif /* LIBCHILD_TRACE_H_ */